@@ -1,14 +1,215 @@
-#include <iostream>
 #include <string>
 #include <memory>
 #include <vector>
 #include <algorithm>
+#include <iterator>
+#include <utility>
 #include <map>
+#include <unordered_map>
+#include <atomic>
+#include <array>
+#include <tuple>
+#include <type_traits>
 #include <stdexcept>
-#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <charconv>
+#include <climits>
+#include <cerrno>
+#include <exception>
+#include <cstdlib>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <deque>
+#include <bitset>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
+//-----------------------------------------------------
+// Output writer
+// All program output goes through one large buffer that is written out only
+// when it is full or at exit. Integers are formatted with to_chars.
+// Optionally, full buffers are handed to a background thread for writing,
+// so that the program does not wait on the write() system call.
+class OutputWriter {
+public:
+    explicit OutputWriter(int fd, size_t capacity = 1 << 16)
+        : fd(fd), capacity(capacity), buffer(new char[capacity]) {}
+    // Writer that appends to a string instead of a file.
+    explicit OutputWriter(string& sink, size_t capacity = 1 << 12)
+        : fd(-1), sink(&sink), capacity(capacity), buffer(new char[capacity]) {}
+    OutputWriter(const OutputWriter&) = delete;
+    OutputWriter& operator=(const OutputWriter&) = delete;
+    ~OutputWriter() {
+        flush();
+        if (worker.joinable()) {
+            {
+                lock_guard<mutex> lock(queueMutex);
+                stopping = true;
+            }
+            queueChanged.notify_all();
+            worker.join();
+        }
+    }
+
+    OutputWriter& operator<<(string_view text) {
+        put(text.data(), text.size());
+        return *this;
+    }
+    OutputWriter& operator<<(const char* text) { return *this << string_view(text); }
+    OutputWriter& operator<<(const string& text) { return *this << string_view(text); }
+    OutputWriter& operator<<(char c) {
+        if (used == capacity) emit();
+        buffer[used++] = c;
+        return *this;
+    }
+    OutputWriter& operator<<(int value) {
+        char digits[16];
+        auto result = to_chars(digits, digits + sizeof digits, value);
+        put(digits, result.ptr - digits);
+        return *this;
+    }
+    OutputWriter& operator<<(size_t value) {
+        char digits[24];
+        auto result = to_chars(digits, digits + sizeof digits, value);
+        put(digits, result.ptr - digits);
+        return *this;
+    }
+
+    // Hand full buffers to a writer thread from now on.
+    void startBackground() {
+        if (!worker.joinable())
+            worker = thread([this] { drain(); });
+    }
+
+    // Write out everything produced so far and wait until it has reached the file.
+    void flush() {
+        emit();
+        if (worker.joinable()) {
+            unique_lock<mutex> lock(queueMutex);
+            queueChanged.wait(lock, [this] { return pending.empty() && !writing; });
+        }
+    }
+
+private:
+    static constexpr size_t maxPending = 4;
+
+    void put(const char* data, size_t size) {
+        if (size > capacity - used) {
+            emit();
+            if (size > capacity) {
+                writeAll(data, size);
+                return;
+            }
+        }
+        memcpy(buffer.get() + used, data, size);
+        used += size;
+    }
+
+    // Pass the current buffer on, either to the writer thread or straight to the file.
+    void emit() {
+        if (used == 0) return;
+        if (!worker.joinable()) {
+            writeAll(buffer.get(), used);
+            used = 0;
+            return;
+        }
+        unique_ptr<char[]> next;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            queueChanged.wait(lock, [this] { return pending.size() < maxPending; });
+            pending.emplace_back(move(buffer), used);
+            if (!spare.empty()) {
+                next = move(spare.back());
+                spare.pop_back();
+            }
+        }
+        queueChanged.notify_all();
+        buffer = next ? move(next) : unique_ptr<char[]>(new char[capacity]);
+        used = 0;
+    }
+
+    void drain() {
+        unique_lock<mutex> lock(queueMutex);
+        while (true) {
+            queueChanged.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) return;
+            auto chunk = move(pending.front());
+            pending.erase(pending.begin());
+            writing = true;
+            lock.unlock();
+            writeAll(chunk.first.get(), chunk.second);
+            lock.lock();
+            writing = false;
+            spare.push_back(move(chunk.first));
+            queueChanged.notify_all();
+        }
+    }
+
+    void writeAll(const char* data, size_t size) {
+        if (sink) {
+            sink->append(data, size);
+            return;
+        }
+        while (size > 0) {
+            ssize_t written = write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    int fd;
+    string* sink = nullptr;
+    size_t capacity;
+    unique_ptr<char[]> buffer;
+    size_t used = 0;
+
+    thread worker;
+    mutex queueMutex;
+    condition_variable queueChanged;
+    vector<pair<unique_ptr<char[]>, size_t>> pending;
+    vector<unique_ptr<char[]>> spare;
+    bool writing = false;
+    bool stopping = false;
+};
+
+// Standard output of the program.
+OutputWriter stdoutWriter(STDOUT_FILENO);
+
+// Writer that output goes to on the current thread. A world running on a
+// worker thread redirects it to its own writer with an OutputRedirect.
+thread_local OutputWriter* currentOutput = &stdoutWriter;
+
+inline OutputWriter& out() { return *currentOutput; }
+
+class OutputRedirect {
+public:
+    explicit OutputRedirect(OutputWriter& writer) : previous(currentOutput) { currentOutput = &writer; }
+    OutputRedirect(const OutputRedirect&) = delete;
+    OutputRedirect& operator=(const OutputRedirect&) = delete;
+    ~OutputRedirect() { currentOutput = previous; }
+
+private:
+    OutputWriter* previous;
+};
+
 //-----------------------------------------------------
 // Forward declarations for classes (do not change!)
 // These declarations allow classes to reference one another.
@@ -20,43 +221,589 @@ class Mouse;
 class BetterMouse;
 class Monster;
 
+//-----------------------------------------------------
+// Animal kinds
+// One-byte tag for each concrete animal class, used as a column in container storage.
+enum class AnimalKind : uint8_t { Mouse, Fish, Bird, BetterMouse, BetterFish, BetterBird, Monster, Unknown };
+constexpr size_t kindCount = size_t(AnimalKind::Unknown) + 1;
+
+// Kind named by a type code in a command. Monsters cannot be named this way.
+AnimalKind parseKind(string_view token) {
+    if (token == "M") return AnimalKind::Mouse;
+    if (token == "F") return AnimalKind::Fish;
+    if (token == "B") return AnimalKind::Bird;
+    if (token == "BM") return AnimalKind::BetterMouse;
+    if (token == "BF") return AnimalKind::BetterFish;
+    if (token == "BB") return AnimalKind::BetterBird;
+    return AnimalKind::Unknown;
+}
+
+// Type code and class name of each kind.
+constexpr const char* typeCodes[kindCount] = {"M", "F", "B", "BM", "BF", "BB", "MON", ""};
+constexpr const char* kindNames[kindCount] = {
+    "Mouse", "Fish", "Bird", "BetterMouse", "BetterFish", "BetterBird", "Monster", ""};
+
+//-----------------------------------------------------
+// Name table
+// Every animal name of a world is stored once, in the world's table, under a
+// compact id. Commands intern into the table of the world they run against (see
+// NameScope), forks share their original's table, and the whole table is freed
+// in bulk with the last world using it, so a world that goes away takes its
+// names with it. Interning takes a lock picked by the hash of the name; reading
+// a name takes none, since a name points at its entry and entries never move.
+// Names of up to inlineCapacity bytes are kept inside their entry; longer ones
+// go to an arena of large blocks per lock shard. Nothing is allocated per name.
+class NameTable {
+public:
+    static constexpr size_t inlineCapacity = 20;
+
+    // A stored name: its id and text, inline or in an arena block.
+    struct Entry {
+        uint32_t id;
+        uint32_t size;
+        const char* spilled; // Text of a name too long to be inline
+        char inlineText[inlineCapacity];
+
+        string_view view() const { return {size > inlineCapacity ? spilled : inlineText, size}; }
+    };
+
+    // Entry of the empty name, shared by every table.
+    static const Entry empty;
+
+    NameTable() = default;
+    NameTable(const NameTable&) = delete;
+    NameTable& operator=(const NameTable&) = delete;
+
+    // Table that names made on this thread go to: the one of the innermost
+    // NameScope, or one for the whole process outside any.
+    static NameTable& current() {
+        static NameTable process;
+        return scoped ? *scoped : process;
+    }
+
+    // Entry of the name, adding it to the table if it is new.
+    const Entry* intern(string_view text) {
+        if (text.empty()) return &empty;
+        Shard& shard = shards[hash<string_view>()(text) % shardCount];
+        lock_guard<mutex> lock(shard.guard);
+        auto found = shard.entries.find(text);
+        if (found != shard.entries.end())
+            return found->second;
+        Entry& entry = newEntry(shard);
+        entry.id = count.fetch_add(1, memory_order_relaxed);
+        entry.size = uint32_t(text.size());
+        if (text.size() <= inlineCapacity)
+            memcpy(entry.inlineText, text.data(), text.size());
+        else
+            entry.spilled = static_cast<char*>(memcpy(spill(shard, text.size()), text.data(), text.size()));
+        shard.entries.emplace(entry.view(), &entry);
+        return &entry;
+    }
+
+    // Make room for about this many more names, for bulk loads.
+    void reserve(size_t names) {
+        for (Shard& shard : shards) {
+            lock_guard<mutex> lock(shard.guard);
+            shard.entries.reserve(shard.entries.size() + names / shardCount + 1);
+        }
+    }
+
+private:
+    friend class NameScope;
+
+    static constexpr size_t shardCount = 16;
+    static constexpr size_t firstBlockEntries = 16;
+    static constexpr size_t maxBlockEntries = 4096;
+    static constexpr size_t arenaBlockSize = 1 << 16;
+
+    struct Shard {
+        mutex guard;
+        unordered_map<string_view, const Entry*> entries; // Views into the entries
+        vector<unique_ptr<Entry[]>> blocks;               // Entries, in blocks of doubling size
+        size_t blockSize = 0;
+        size_t blockUsed = 0;
+        vector<unique_ptr<char[]>> arena;                 // Blocks holding the longer names
+        char* arenaNext = nullptr;
+        size_t arenaLeft = 0;
+    };
+
+    // Room for an entry in the shard's blocks; the shard is locked.
+    Entry& newEntry(Shard& shard) {
+        if (shard.blockUsed == shard.blockSize) {
+            shard.blockSize = shard.blockSize ? min(shard.blockSize * 2, maxBlockEntries) : firstBlockEntries;
+            shard.blocks.push_back(make_unique<Entry[]>(shard.blockSize));
+            shard.blockUsed = 0;
+        }
+        return shard.blocks.back()[shard.blockUsed++];
+    }
+
+    // Room for a long name in the shard's arena; the shard is locked.
+    char* spill(Shard& shard, size_t size) {
+        if (size > shard.arenaLeft) {
+            size_t block = max(size, arenaBlockSize);
+            shard.arena.push_back(make_unique<char[]>(block));
+            shard.arenaNext = shard.arena.back().get();
+            shard.arenaLeft = block;
+        }
+        char* bytes = shard.arenaNext;
+        shard.arenaNext += size;
+        shard.arenaLeft -= size;
+        return bytes;
+    }
+
+    static thread_local NameTable* scoped;
+
+    array<Shard, shardCount> shards;
+    atomic<uint32_t> count{1}; // Id 0 is the empty name
+};
+
+const NameTable::Entry NameTable::empty = {};
+thread_local NameTable* NameTable::scoped = nullptr;
+
+// Makes names created on this thread go to the given table while it exists.
+// Whatever reads or writes commands for a world holds one for the world's table.
+class NameScope {
+public:
+    explicit NameScope(NameTable& table) : previous(NameTable::scoped) { NameTable::scoped = &table; }
+    NameScope(const NameScope&) = delete;
+    NameScope& operator=(const NameScope&) = delete;
+    ~NameScope() { NameTable::scoped = previous; }
+
+private:
+    NameTable* previous;
+};
+
+// An interned name: its table entry plus a key made of its first eight bytes
+// (big-endian, zero-padded), which orders the same way as the text does.
+// Comparing two names is an integer comparison unless those bytes agree. Names
+// are only compared with names of the same table.
+class Name {
+public:
+    Name() = default; // The empty name
+    Name(string_view text) : key(prefixKey(text)), entry(NameTable::current().intern(text)) {}
+    Name(const string& text) : Name(string_view(text)) {}
+    Name(const char* text) : Name(string_view(text)) {}
+
+    string_view str() const { return entry->view(); }
+    uint32_t getId() const { return entry->id; }
+    uint64_t getKey() const { return key; }
+
+    bool operator==(const Name& other) const { return entry == other.entry; }
+    bool operator<(const Name& other) const {
+        if (key != other.key)
+            return key < other.key;
+        return entry != other.entry && str() < other.str();
+    }
+
+private:
+    static uint64_t prefixKey(string_view text) {
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < 8; i++)
+            prefix = (prefix << 8) | (i < text.size() ? (unsigned char)text[i] : 0);
+        return prefix;
+    }
+
+    uint64_t key = 0;
+    const NameTable::Entry* entry = &NameTable::empty;
+};
+
+//-----------------------------------------------------
+// Copy-on-write vector
+// A vector stored in pages of 1024 elements. Copying it copies only the page
+// table: the pages are shared, reference counted, and a page is copied the
+// first time one of the sharers writes to it. Reads go through operator[],
+// writes through edit(), so a read never copies. The first page starts at 16
+// elements and doubles until it is full, so short vectors stay short. Sharers
+// may live on different threads; each single vector is used from one thread
+// at a time.
+template <typename T>
+class CowVector {
+public:
+    CowVector() = default;
+    CowVector(size_t count, const T& value) { resize(count, value); }
+    CowVector(const CowVector& other) : pages(other.pages), count(other.count), capacity(other.capacity) {
+        for (const Slot& slot : pages)
+            slot.page->refs.fetch_add(1, memory_order_relaxed);
+    }
+    CowVector& operator=(const CowVector& other) {
+        CowVector copy(other);
+        swap(copy);
+        return *this;
+    }
+    ~CowVector() { release(); }
+
+    void swap(CowVector& other) {
+        pages.swap(other.pages);
+        std::swap(count, other.count);
+        std::swap(capacity, other.capacity);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T& operator[](size_t i) const { return pages[i >> pageBits].items[i & pageMask]; }
+    const T& back() const { return (*this)[count - 1]; }
+
+    // Element i for writing; its page is copied first if it is shared.
+    T& edit(size_t i) {
+        Slot& slot = pages[i >> pageBits];
+        if (slot.page->refs.load(memory_order_acquire) != 1)
+            slot = copyOf(slot, slot.page->size);
+        return slot.items[i & pageMask];
+    }
+
+    void push_back(const T& value) {
+        if (count == capacity) {
+            if (capacity < pageSize)
+                growFirst(max(capacity * 2, firstPageSize));
+            else
+                pages.push_back(copyOf({}, pageSize));
+            capacity = (pages.size() - 1) * pageSize + pages.back().page->size;
+        }
+        edit(count++) = value;
+    }
+    void emplace_back() { push_back(T()); }
+    void pop_back() { --count; }
+
+    void resize(size_t newCount, const T& value = T()) {
+        if (newCount > capacity && capacity < pageSize) {
+            size_t size = max(capacity * 2, firstPageSize);
+            while (size < newCount && size < pageSize)
+                size *= 2;
+            growFirst(size);
+            capacity = size;
+        }
+        while (count < newCount)
+            push_back(value);
+        count = newCount;
+    }
+    void clear() {
+        release();
+        pages.clear();
+        count = capacity = 0;
+    }
+
+private:
+    static constexpr size_t pageBits = 10;
+    static constexpr size_t pageSize = size_t(1) << pageBits;
+    static constexpr size_t pageMask = pageSize - 1;
+    static constexpr size_t firstPageSize = 16;
+
+    struct Page {
+        explicit Page(size_t size) : items(new T[size]), size(size) {}
+        atomic<uint32_t> refs{1};
+        unique_ptr<T[]> items;
+        size_t size;
+    };
+    // A page with its items at hand, so a read follows one pointer.
+    struct Slot {
+        Page* page = nullptr;
+        T* items = nullptr;
+    };
+
+    static void unshare(Page* page) {
+        if (page->refs.fetch_sub(1, memory_order_acq_rel) == 1)
+            delete page;
+    }
+    void release() {
+        for (const Slot& slot : pages)
+            unshare(slot.page);
+    }
+
+    // A private page of the given size holding the items of the slot's page, if any,
+    // which the slot gives up.
+    static Slot copyOf(Slot slot, size_t size) {
+        Page* page = new Page(size);
+        if (slot.page) {
+            std::copy(slot.items, slot.items + min(size, slot.page->size), page->items.get());
+            unshare(slot.page);
+        }
+        return {page, page->items.get()};
+    }
+
+    // Makes the first page, the only one, hold size items.
+    void growFirst(size_t size) {
+        if (pages.empty())
+            pages.emplace_back();
+        pages[0] = copyOf(pages[0], size);
+    }
+
+    vector<Slot> pages;
+    size_t count = 0;
+    size_t capacity = 0; // Items the pages hold
+};
+
+//-----------------------------------------------------
+// Rows by name
+// Hash index from name ids to the rows holding them, one entry per row, so a
+// name held by several animals has several entries. Open addressing with linear
+// probing in a flat table kept at most half full; a removal shifts the entries
+// after it back, so the table never holds tombstones. The table is copy-on-write.
+class RowsByName {
+public:
+    void add(uint32_t id, int row) {
+        if ((used + 1) * 2 > table.size())
+            grow();
+        place({id, row});
+        ++used;
+    }
+
+    void remove(uint32_t id, int row) {
+        if (table.empty()) return;
+        size_t i = home(id);
+        while (table[i].row >= 0 && !(table[i].id == id && table[i].row == row))
+            i = (i + 1) & mask();
+        if (table[i].row < 0) return;
+        // Move back any later entry of the probe run that may sit in the hole.
+        for (size_t j = (i + 1) & mask(); table[j].row >= 0; j = (j + 1) & mask())
+            if (((j - home(table[j].id)) & mask()) >= ((j - i) & mask())) {
+                table.edit(i) = table[j];
+                i = j;
+            }
+        table.edit(i).row = -1;
+        --used;
+    }
+
+    // Call visit with every row holding the name.
+    template <typename Visit>
+    void forEach(uint32_t id, Visit visit) const {
+        if (table.empty()) return;
+        for (size_t i = home(id); table[i].row >= 0; i = (i + 1) & mask())
+            if (table[i].id == id)
+                visit(table[i].row);
+    }
+
+    void clear() {
+        table.clear();
+        used = 0;
+    }
+
+private:
+    struct Entry {
+        uint32_t id;
+        int row; // -1 when the entry is empty
+    };
+
+    size_t mask() const { return table.size() - 1; }
+    size_t home(uint32_t id) const { return size_t((id * 0x9E3779B97F4A7C15ull) >> 32) & mask(); }
+
+    void place(Entry entry) {
+        size_t i = home(entry.id);
+        while (table[i].row >= 0)
+            i = (i + 1) & mask();
+        table.edit(i) = entry;
+    }
+
+    void grow() {
+        CowVector<Entry> old(max<size_t>(16, table.size() * 2), Entry{0, -1});
+        old.swap(table);
+        for (size_t i = 0; i < old.size(); i++)
+            if (old[i].row >= 0)
+                place(old[i]);
+    }
+
+    CowVector<Entry> table; // Size is a power of two
+    size_t used = 0;
+};
+
+//-----------------------------------------------------
+// Latency histogram
+// HDR-style: values are grouped by their power of two, and each power of two is
+// split into 16 linear sub-buckets, which keeps the relative error of a
+// reported percentile under about 6% over the whole range of 64-bit values.
+class LatencyHistogram {
+public:
+    void record(uint64_t value) {
+        ++buckets[bucketOf(value)];
+        ++count;
+        total += value;
+        maximum = max(maximum, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < bucketCount; i++)
+            buckets[i] += other.buckets[i];
+        count += other.count;
+        total += other.total;
+        maximum = max(maximum, other.maximum);
+    }
+
+    // Upper bound of the bucket holding the given fraction of the values.
+    uint64_t percentile(double fraction) const {
+        if (count == 0) return 0;
+        uint64_t rank = uint64_t(fraction * (count - 1)) + 1, seen = 0;
+        for (size_t i = 0; i < bucketCount; i++) {
+            seen += buckets[i];
+            if (seen >= rank) return min(upperBound(i), maximum);
+        }
+        return maximum;
+    }
+
+    uint64_t getCount() const { return count; }
+    uint64_t getTotal() const { return total; }
+    uint64_t getMax() const { return maximum; }
+
+private:
+    static constexpr size_t subBits = 4;
+    static constexpr size_t bucketCount = (64 - subBits + 1) << subBits;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < (1u << subBits)) return size_t(value);
+        int shift = 63 - __builtin_clzll(value) - int(subBits);
+        return (size_t(shift + 1) << subBits) + size_t((value >> shift) & ((1u << subBits) - 1));
+    }
+    static uint64_t upperBound(size_t bucket) {
+        if (bucket < (1u << subBits)) return bucket;
+        int shift = int(bucket >> subBits) - 1;
+        uint64_t sub = bucket & ((1u << subBits) - 1);
+        return (((1ull << subBits) + sub + 1) << shift) - 1;
+    }
+
+    array<uint64_t, bucketCount> buckets{};
+    uint64_t count = 0, total = 0, maximum = 0;
+};
+
+inline uint64_t nowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//-----------------------------------------------------
+// Statistics
+// Opt-in instrumentation (--stats): command latencies per command and per
+// container, operation counters and peak container sizes. Code paths check the
+// thread-local stats pointer, which is null unless statistics were requested,
+// so the cost when disabled is one predictable branch.
+struct Stats {
+    Stats(size_t commandKinds, size_t containers)
+        : commands(commandKinds), containers(containers), peakSize(containers) {}
+
+    void merge(const Stats& other) {
+        for (size_t i = 0; i < commands.size(); i++)
+            commands[i].merge(other.commands[i]);
+        for (size_t i = 0; i < containers.size(); i++) {
+            containers[i].merge(other.containers[i]);
+            peakSize[i] = max(peakSize[i], other.peakSize[i]);
+        }
+        sorts += other.sorts;
+        removeSteps += other.removeSteps;
+        deaths += other.deaths;
+        attackKills += other.attackKills;
+        monsterConversions += other.monsterConversions;
+    }
+
+    vector<LatencyHistogram> commands;   // Latency per command type
+    vector<LatencyHistogram> containers; // Latency per target container (PERIOD: each container's share)
+    vector<size_t> peakSize;             // Largest size seen per container
+    uint64_t sorts = 0;                  // Full re-sorts of a container
+    uint64_t removeSteps = 0;            // Tree nodes visited by positional removals
+    uint64_t deaths = 0;                 // Deaths of old age (and Monster expiry) in PERIOD
+    uint64_t attackKills = 0;            // Animals removed after an attack
+    uint64_t monsterConversions = 0;     // Animals turned into Monsters
+};
+
+thread_local Stats* stats = nullptr;
+
+//-----------------------------------------------------
+// Animal storage
+// Containers keep the data of their animals in columns. An animal placed in a
+// container is bound to one row of that storage and reads its days from there.
+// Days are stored relative to a day counter, so that aging every row at once
+// is a single increment. The number of rows per stored days value is kept up to
+// date alongside, for census queries; aging does not change it.
+class AnimalStore {
+public:
+    virtual ~AnimalStore() = default;
+    int daysAt(int row) const { return int(days[row] + day); }
+    void setDaysAt(int row, int value) {
+        countDays(days[row], -1);
+        days.edit(row) = value - day;
+        countDays(days[row], 1);
+        daysChanged(row);
+    }
+
+protected:
+    virtual void daysChanged(int) {}
+
+    void countDays(long long stored, int delta) {
+        auto entry = dayCounts.emplace(stored, 0).first;
+        if ((entry->second += delta) == 0)
+            dayCounts.erase(entry);
+    }
+
+    CowVector<long long> days;        // Days lived per row, relative to the day counter
+    long long day = 0;                // Days passed since the storage was created
+    map<long long, size_t> dayCounts; // Rows per relative days value
+};
+
 //-----------------------------------------------------
 // Base Animal class
 // Defines the basic interface and properties for all animals.
+// The concrete class of an animal is also kept as a one-byte kind tag, set by the
+// most derived constructor, so type codes and attacks are table lookups.
 class Animal {
 private:
-    const string name;  // Unique animal name (immutable)
-    int daysLived;      // Number of days the animal has lived
+    const Name name;              // Unique animal name (immutable, interned)
+    int daysLived;                // Number of days the animal has lived, while not stored
+    AnimalStore* store = nullptr; // Container storage this animal is a view of, if any
+    int row = -1;                 // Row of the animal in that storage
+    const AnimalKind kind;        // Concrete class of the animal
 
 public:
     // Constructors and destructor
-    Animal() : name(""), daysLived(0) {}
-    Animal(const string& name, int daysLived) : name(name), daysLived(daysLived) {}
-    Animal(const Animal& other) : name(other.name), daysLived(other.daysLived) {}
+    Animal() : name(), daysLived(0), kind(AnimalKind::Unknown) {}
+    Animal(Name name, int daysLived, AnimalKind kind) : name(name), daysLived(daysLived), kind(kind) {}
+    Animal(const Animal& other) : name(other.name), daysLived(other.getDaysLived()), kind(other.kind) {}
     virtual ~Animal() = default;
 
     // Getters and setter
-    int getDaysLived() const { return daysLived; }
-    string getName() const { return name; }
-    void setDaysLived(int newValue) { daysLived = newValue; }
+    int getDaysLived() const { return store ? store->daysAt(row) : daysLived; }
+    string getName() const { return string(name.str()); }
+    const Name& getInternedName() const { return name; }
+    AnimalKind getKind() const { return kind; }
+    void setDaysLived(int newValue) {
+        if (store)
+            store->setDaysAt(row, newValue);
+        else
+            daysLived = newValue;
+    }
+
+    // Make the animal a view of a storage row, which already holds its days.
+    // Unbinding copies the current days back into the animal.
+    void bind(AnimalStore* newStore, int newRow) {
+        store = newStore;
+        row = newRow;
+    }
+    void unbind() {
+        daysLived = getDaysLived();
+        store = nullptr;
+        row = -1;
+    }
 
-    // Pure virtual functions:
     // attack: defines how an animal attacks another (sets target's daysLived to 11).
     // getType: returns the type code for the animal.
-    virtual void attack(Animal& other) = 0;
-    virtual string getType() const = 0;
+    void attack(Animal& other) const {
+        announceAttack(kind);
+        other.setDaysLived(11);
+    }
+    string getType() const { return typeCodes[size_t(kind)]; }
 
     // Comparison operator used for sorting:
     // Animals are sorted first by daysLived and then lexicographically by name.
     bool operator<(const Animal& other) const {
-        if (daysLived != other.daysLived)
-            return daysLived < other.daysLived;
+        if (getDaysLived() != other.getDaysLived())
+            return getDaysLived() < other.getDaysLived();
         return name < other.name;
     }
 
     // talk: Prints out the animal's information.
-    void talk() const {
-        cout << "My name is " << name << ", days lived: " << daysLived << endl;
+    void talk() const { talk(name, getDaysLived()); }
+
+    // The same lines for an animal known only by its stored data.
+    static void talk(const Name& name, int daysLived) {
+        out() << "My name is " << name.str() << ", days lived: " << daysLived << '\n';
+    }
+    static void announceAttack(AnimalKind attacker) {
+        out() << kindNames[size_t(attacker)] << " is attacking" << '\n';
     }
 
     // Grant friend access to derived classes to access private members if needed.
@@ -71,89 +818,119 @@ public:
 
 //-----------------------------------------------------
 // Concrete animal classes implementations
-// Each attack method sets the target's daysLived to 11.
+// Each class only names its kind; the default constructors are for the Better
+// classes, which construct the virtual Animal base themselves.
 class Fish : virtual public Animal {
 public:
-    using Animal::Animal; // Inherit constructors.
-    void attack(Animal& other) override {
-        cout << "Fish is attacking" << endl;
-        other.setDaysLived(11);
-    }
-    string getType() const override { return "F"; }
+    Fish(Name name, int daysLived) : Animal(name, daysLived, AnimalKind::Fish) {}
+
+protected:
+    Fish() = default;
 };
 
 class BetterFish : public Fish {
 public:
     // Constructor for BetterFish with explicit values.
-    BetterFish(const string& name, int daysLived) : Animal(name, daysLived) {}
+    BetterFish(Name name, int daysLived) : Animal(name, daysLived, AnimalKind::BetterFish) {}
     // Conversion constructor: creates a BetterFish from a Fish,
     // halving the daysLived (rounded up).
-    BetterFish(const Fish& fish) : Animal(fish.getName(), (fish.getDaysLived() + 1) / 2) {}
-    void attack(Animal& other) override {
-        cout << "BetterFish is attacking" << endl;
-        other.setDaysLived(11);
-    }
-    string getType() const override { return "BF"; }
+    BetterFish(const Fish& fish)
+        : Animal(fish.getInternedName(), (fish.getDaysLived() + 1) / 2, AnimalKind::BetterFish) {}
 };
 
 class Bird : virtual public Animal {
 public:
-    using Animal::Animal;
-    void attack(Animal& other) override {
-        cout << "Bird is attacking" << endl;
-        other.setDaysLived(11);
-    }
-    string getType() const override { return "B"; }
+    Bird(Name name, int daysLived) : Animal(name, daysLived, AnimalKind::Bird) {}
+
+protected:
+    Bird() = default;
 };
 
 class BetterBird : public Bird {
 public:
-    BetterBird(const string& name, int daysLived) : Animal(name, daysLived) {}
-    BetterBird(const Bird& bird) : Animal(bird.getName(), (bird.getDaysLived() + 1) / 2) {}
-    void attack(Animal& other) override {
-        cout << "BetterBird is attacking" << endl;
-        other.setDaysLived(11);
-    }
-    string getType() const override { return "BB"; }
+    BetterBird(Name name, int daysLived) : Animal(name, daysLived, AnimalKind::BetterBird) {}
+    BetterBird(const Bird& bird)
+        : Animal(bird.getInternedName(), (bird.getDaysLived() + 1) / 2, AnimalKind::BetterBird) {}
 };
 
 class Mouse : virtual public Animal {
 public:
-    using Animal::Animal;
-    void attack(Animal& other) override {
-        cout << "Mouse is attacking" << endl;
-        other.setDaysLived(11);
-    }
-    string getType() const override { return "M"; }
+    Mouse(Name name, int daysLived) : Animal(name, daysLived, AnimalKind::Mouse) {}
+
+protected:
+    Mouse() = default;
 };
 
 class BetterMouse : public Mouse {
 public:
-    BetterMouse(const string& name, int daysLived) : Animal(name, daysLived) {}
-    BetterMouse(const Mouse& mouse) : Animal(mouse.getName(), (mouse.getDaysLived() + 1) / 2) {}
-    void attack(Animal& other) override {
-        cout << "BetterMouse is attacking" << endl;
-        other.setDaysLived(11);
-    }
-    string getType() const override { return "BM"; }
+    BetterMouse(Name name, int daysLived) : Animal(name, daysLived, AnimalKind::BetterMouse) {}
+    BetterMouse(const Mouse& mouse)
+        : Animal(mouse.getInternedName(), (mouse.getDaysLived() + 1) / 2, AnimalKind::BetterMouse) {}
 };
 
 class Monster : public BetterFish, public BetterBird, public BetterMouse {
 public:
     // Monster always starts with 1 day lived.
-    Monster(const string& name) : Animal(name, 1), BetterFish("", 0), BetterBird("", 0), BetterMouse("", 0) {}
+    Monster(Name name)
+        : Animal(name, 1, AnimalKind::Monster), BetterFish("", 0), BetterBird("", 0), BetterMouse("", 0) {}
     // Conversion constructor: creates a Monster from any animal.
-    Monster(const Animal& animal) : Animal(animal.getName(), 1), BetterFish("", 0), BetterBird("", 0), BetterMouse("", 0) {}
-    void attack(Animal& other) override {
-        cout << "Monster is attacking" << endl;
-        other.setDaysLived(11);
-    }
-    string getType() const override { return "MON"; }
+    Monster(const Animal& animal) : Monster(animal.getInternedName()) {}
 };
 
+// Days lived after a substance turns an animal into its better version.
+constexpr int betterDays(int days) { return (days + 1) / 2; }
+constexpr int monsterDays = 1;
+
+// Whether an animal of the given kind is a T.
+template <typename T>
+constexpr bool holdsKind(AnimalKind kind) {
+    switch (kind) {
+    case AnimalKind::Mouse: return is_base_of_v<T, Mouse>;
+    case AnimalKind::Fish: return is_base_of_v<T, Fish>;
+    case AnimalKind::Bird: return is_base_of_v<T, Bird>;
+    case AnimalKind::BetterMouse: return is_base_of_v<T, BetterMouse>;
+    case AnimalKind::BetterFish: return is_base_of_v<T, BetterFish>;
+    case AnimalKind::BetterBird: return is_base_of_v<T, BetterBird>;
+    case AnimalKind::Monster: return is_base_of_v<T, Monster>;
+    default: return false;
+    }
+}
+
+// New animal of the given kind, held as a T; null if that kind is not a T.
+template <typename T, typename K>
+shared_ptr<T> makeAs(Name name, int days) {
+    if constexpr (!is_base_of_v<T, K>)
+        return nullptr;
+    else if constexpr (is_same_v<K, Monster>)
+        return make_shared<Monster>(name);
+    else
+        return make_shared<K>(name, days);
+}
+
+template <typename T>
+shared_ptr<T> makeOfKind(AnimalKind kind, Name name, int days) {
+    switch (kind) {
+    case AnimalKind::Mouse: return makeAs<T, Mouse>(name, days);
+    case AnimalKind::Fish: return makeAs<T, Fish>(name, days);
+    case AnimalKind::Bird: return makeAs<T, Bird>(name, days);
+    case AnimalKind::BetterMouse: return makeAs<T, BetterMouse>(name, days);
+    case AnimalKind::BetterFish: return makeAs<T, BetterFish>(name, days);
+    case AnimalKind::BetterBird: return makeAs<T, BetterBird>(name, days);
+    case AnimalKind::Monster: return makeAs<T, Monster>(name, days);
+    default: return nullptr;
+    }
+}
+
 //-----------------------------------------------------
 // Container interface
 // Provides a common interface for container operations.
+// What a container keeps about one animal.
+struct AnimalRecord {
+    AnimalKind kind;
+    Name name;
+    int days;
+};
+
 class IContainer {
 public:
     virtual ~IContainer() = default;
@@ -162,42 +939,103 @@ public:
     virtual shared_ptr<Animal> removeAtIndex(int pos) = 0;
     virtual size_t size() const = 0;
     virtual void clear() = 0;
+    // The same operations on stored data, without animal objects: add an animal
+    // of the given kind (invalid_argument if the container cannot hold it), read
+    // the one at a position and drop it (out_of_range if there is none).
+    virtual void addNew(AnimalKind kind, Name name, int days) = 0;
+    virtual AnimalRecord recordAt(int pos) = 0;
+    virtual void discardAt(int pos) = 0;
+    // Age every animal by one day and return the names of those that died, in container order.
+    virtual vector<Name> advanceDay() = 0;
+    // Number of days that can pass without any animal dying, at least (0 if one
+    // may die on the next), and a way to let that many pass in O(1).
+    virtual long long quietDays() const = 0;
+    virtual void skipDays(long long days) = 0;
+    // The contents in sorted order, and a rebuild from contents already in that
+    // order (false, leaving the container empty, if they are not or do not fit).
+    virtual vector<AnimalRecord> sortedContents() = 0;
+    // Census: animals with days lived in [lo, hi], by rank in the sorted order
+    // in O(log n), and the count per days lived value added into counts from the
+    // per-days counts, in O(d log d) for d distinct values.
+    virtual size_t countInRange(int lo, int hi) = 0;
+    virtual void addHistogram(map<int, size_t>& counts) const = 0;
+    virtual bool restoreSorted(const vector<AnimalRecord>& contents) = 0;
+    // Position of the first animal with the given name, or -1 if there is none.
+    virtual int positionOf(const Name& name) = 0;
+    // Become a copy of a container of the same type, sharing its storage until
+    // either one writes to it; the source's pending animals are linked first.
+    virtual void forkFrom(IContainer& source) = 0;
 };
 
 //-----------------------------------------------------
 // Template base container class
 // Implements common container functionalities and ordering for a given animal type.
+// Animal data is stored column-wise: days, names and kind tags each live in their
+// own array, indexed by row. Rows are linked into an order-statistic treap keyed on
+// (daysLived, name), whose in-order walk is the sorted permutation of the rows;
+// insertion, positional lookup and positional removal are all O(log n).
+// New rows are only linked in once something needs the order (a positional
+// access or a PERIOD), so a burst of insertions costs one sort and one O(n) build.
+// The Animal objects handed out are views bound to their row, created on first use.
+// A hash index from name to rows finds an animal by name without a scan.
+// All row storage is copy-on-write, so a container can be forked cheaply.
 template <typename T>
-class Container : public IContainer {
+class Container : public IContainer, protected AnimalStore {
 public:
     // Reorder the container based on daysLived and name.
+    // Only needed if animals were modified from outside; insertion keeps the order.
     void reorder() {
-        sort(animals.begin(), animals.end(),
-            [](const auto& a, const auto& b) {
-                if(a->getDaysLived() != b->getDaysLived())
-                    return a->getDaysLived() < b->getDaysLived();
-                return a->getName() < b->getName();
-            });
+        settle();
+        if (stats) ++stats->sorts;
+        vector<int> order;
+        order.reserve(size());
+        collect(root, order);
+        sortRows(order);
+        root = build(order);
     }
 
-    virtual ~Container() = default;
+    virtual ~Container() { clear(); }
 
     // Pure virtual function to add an animal of type T.
     virtual void add(shared_ptr<T> animal) = 0;
 
-    // Convert a generic Animal pointer to type T and add it.
+    // Add a generic animal, if its kind is a T. The container keeps its data and
+    // hands out its own view of the animal from then on.
     void addAnimal(shared_ptr<Animal> animal) override {
-        auto derived = dynamic_pointer_cast<T>(animal);
-        if (!derived)
+        if (!animal)
+            throw invalid_argument("");
+        addNew(animal->getKind(), animal->getInternedName(), animal->getDaysLived());
+    }
+
+    void addNew(AnimalKind kind, Name name, int days) override {
+        if (!holdsKind<T>(kind))
             throw invalid_argument("");
-        add(derived);
+        insertRow(kind, name, days);
+    }
+
+    AnimalRecord recordAt(int pos) override {
+        if (pos < 0 || pos >= size())
+            throw out_of_range("");
+        settle();
+        int r = rowAt(pos);
+        return {kinds[r], names[r], daysAt(r)};
+    }
+
+    void discardAt(int pos) override {
+        if (pos < 0 || pos >= size())
+            throw out_of_range("");
+        settle();
+        int removed = -1;
+        root = eraseAt(root, pos, removed);
+        drop(removed);
     }
 
     // Return the animal at the specified position.
     shared_ptr<T> getAnimal(int pos) {
-        if (pos < 0 || pos >= animals.size())
+        if (pos < 0 || pos >= size())
             throw out_of_range("");
-        return animals[pos];
+        settle();
+        return view(rowAt(pos));
     }
 
     shared_ptr<Animal> getAnimalAt(int pos) override {
@@ -206,11 +1044,12 @@ public:
 
     // Remove and return the animal at the specified position.
     shared_ptr<T> removeAt(int pos) {
-        if (pos < 0 || pos >= animals.size())
+        if (pos < 0 || pos >= size())
             throw out_of_range("");
-        auto animal = animals[pos];
-        animals.erase(animals.begin() + pos);
-        return animal;
+        settle();
+        int removed = -1;
+        root = eraseAt(root, pos, removed);
+        return release(removed);
     }
 
     shared_ptr<Animal> removeAtIndex(int pos) override {
@@ -218,35 +1057,565 @@ public:
     }
 
     // Clear all animals from the container.
-    void clear() override { animals.clear(); }
-    size_t size() const override { return animals.size(); }
+    void clear() override {
+        for (auto& view : views)
+            if (view)
+                view->unbind();
+        days.clear();
+        names.clear();
+        kinds.clear();
+        views.clear();
+        left.clear();
+        right.clear();
+        weight.clear();
+        priority.clear();
+        generation.clear();
+        dueDay.clear();
+        freeRows.clear();
+        for (auto& bucket : wheel)
+            bucket.clear();
+        pending.clear();
+        dayCounts.clear();
+        rowsByName.clear();
+        monsters = 0;
+        root = -1;
+    }
+    size_t size() const override { return weightOf(root) + pending.size(); }
 
-protected:
-    vector<shared_ptr<T>> animals; // Underlying vector storing pointers to animals of type T.
-};
+    // PERIOD: one more day for every animal. Only the wheel bucket of the new
+    // day is looked at; the rows due on it die, in container order.
+    vector<Name> advanceDay() override {
+        settle();
+        ++day;
+        vector<int> dying;
+        auto& bucket = wheel[size_t(day) % wheelSize];
+        size_t kept = 0;
+        for (size_t i = 0; i < bucket.size(); i++) {
+            Timer timer = bucket[i];
+            if (generation[timer.row] != timer.generation || dueDay[timer.row] != timer.due)
+                continue; // the row was freed or rescheduled
+            if (timer.due == day) {
+                dying.push_back(timer.row);
+                dueDay.edit(timer.row) = LLONG_MIN; // any other entry for the row is stale
+            } else
+                bucket.edit(kept++) = timer; // due a later turn of the wheel
+        }
+        bucket.resize(kept);
 
-//-----------------------------------------------------
-// Cage container – allowed for birds and mice only.
-// It sorts the animals automatically upon addition.
-template <typename T>
-class Cage : public Container<T> {
-public:
-    void add(shared_ptr<T> animal) override {
-        this->animals.push_back(animal);
-        this->reorder();
+        sortRows(dying);
+        vector<Name> dead;
+        dead.reserve(dying.size());
+        for (int r : dying) {
+            bool found = false;
+            root = eraseRow(root, r, found);
+            dead.push_back(names[r]);
+            drop(r);
+        }
+        return dead;
     }
-};
 
-// Specializations to disallow Cage for Fish and BetterFish.
-template <>
-class Cage<Fish> {
-public:
-    Cage() = delete;
-    Cage(const Cage<Fish>&) = delete;
-    Cage& operator=(const Cage<Fish>&) = delete;
-};
+    // The oldest animal is the first to pass 10 days, and a Monster dies on the
+    // next day.
+    long long quietDays() const override {
+        if (dayCounts.empty()) return LLONG_MAX;
+        if (monsters > 0) return 0;
+        return max(0LL, 10 - (dayCounts.rbegin()->first + day));
+    }
 
-template <>
+    // No timer falls due in the days passed over, so the wheel needs no visit.
+    // An empty container has nothing relative to its day counter and restarts it.
+    void skipDays(long long days) override {
+        if (dayCounts.empty())
+            day = 0;
+        else
+            day += days;
+    }
+
+    vector<AnimalRecord> sortedContents() override {
+        settle();
+        vector<int> order;
+        order.reserve(size());
+        collect(root, order);
+        vector<AnimalRecord> contents;
+        contents.reserve(order.size());
+        for (int r : order)
+            contents.push_back({kinds[r], names[r], daysAt(r)});
+        return contents;
+    }
+
+    size_t countInRange(int lo, int hi) override {
+        if (lo > hi) return 0;
+        settle();
+        return rowsBelow(storedDays(hi) + 1) - rowsBelow(storedDays(lo));
+    }
+
+    void addHistogram(map<int, size_t>& counts) const override {
+        for (auto& entry : dayCounts)
+            counts[int(entry.first + day)] += entry.second;
+    }
+
+    // Rows are linked in the given order, without sorting; the animal objects
+    // are left to be created when first asked for.
+    bool restoreSorted(const vector<AnimalRecord>& contents) override {
+        clear();
+        vector<int> order;
+        order.reserve(contents.size());
+        for (const AnimalRecord& animal : contents) {
+            if (!holdsKind<T>(animal.kind)) {
+                clear();
+                return false;
+            }
+            int r = allocRow();
+            days.edit(r) = animal.days - day;
+            countDays(days[r], 1);
+            names.edit(r) = animal.name;
+            kinds.edit(r) = animal.kind;
+            rowsByName.add(animal.name.getId(), r);
+            monsters += animal.kind == AnimalKind::Monster;
+            left.edit(r) = right.edit(r) = -1;
+            weight.edit(r) = 1;
+            priority.edit(r) = nextPriority();
+            schedule(r);
+            if (!order.empty() && less(r, order.back())) {
+                clear();
+                return false;
+            }
+            order.push_back(r);
+        }
+        root = build(order);
+        return true;
+    }
+
+    // Every column is shared by page; the animal objects are not, and the copy
+    // creates its own when asked for them.
+    void forkFrom(IContainer& source) override {
+        auto& other = static_cast<Container&>(source);
+        other.settle();
+        clear();
+        days = other.days;
+        day = other.day;
+        dayCounts = other.dayCounts;
+        names = other.names;
+        kinds = other.kinds;
+        left = other.left;
+        right = other.right;
+        weight = other.weight;
+        priority = other.priority;
+        generation = other.generation;
+        dueDay = other.dueDay;
+        freeRows = other.freeRows;
+        wheel = other.wheel;
+        rowsByName = other.rowsByName;
+        monsters = other.monsters;
+        root = other.root;
+        seed = other.seed;
+    }
+
+    // The rows of a name come from the index; each one's position is found from
+    // its key, so a lookup costs O(log n) per animal of that name.
+    int positionOf(const Name& name) override {
+        int first = -1;
+        bool settled = false;
+        rowsByName.forEach(name.getId(), [&](int r) {
+            if (!settled) {
+                settle();
+                settled = true;
+            }
+            int pos = rankOf(root, r, 0);
+            if (first < 0 || pos < first)
+                first = pos;
+        });
+        return first;
+    }
+
+protected:
+    // Insert an animal; it takes its sorted position, after any equal keys,
+    // before the order is next needed.
+    void insertSorted(shared_ptr<T> animal) {
+        int r = insertRow(animal->getKind(), animal->getInternedName(), animal->getDaysLived());
+        animal->bind(this, r);
+        viewOf(r) = move(animal);
+    }
+
+    int insertRow(AnimalKind kind, Name name, int daysLived) {
+        int r = allocRow();
+        days.edit(r) = daysLived - day;
+        countDays(days[r], 1);
+        names.edit(r) = name;
+        kinds.edit(r) = kind;
+        rowsByName.add(name.getId(), r);
+        monsters += kind == AnimalKind::Monster;
+        left.edit(r) = right.edit(r) = -1;
+        weight.edit(r) = 1;
+        priority.edit(r) = nextPriority();
+        schedule(r);
+        pending.push_back(r);
+        return r;
+    }
+
+    // Link the pending rows into the tree. A few are inserted one by one; more
+    // are sorted and merged with the tree's rows, and the tree is rebuilt.
+    void settle() {
+        if (pending.empty()) return;
+        auto byKey = [this](int a, int b) { return less(a, b); };
+        sortRows(pending);
+        if (pending.size() == 1 || pending.size() * 8 < size_t(weightOf(root))) {
+            for (int r : pending)
+                root = insert(root, r);
+        } else {
+            if (stats) ++stats->sorts;
+            vector<int> order, merged;
+            order.reserve(weightOf(root));
+            collect(root, order);
+            merged.reserve(order.size() + pending.size());
+            std::merge(order.begin(), order.end(), pending.begin(), pending.end(), back_inserter(merged), byKey);
+            root = build(merged);
+        }
+        pending.clear();
+    }
+
+private:
+    // Row columns besides the inherited days.
+    CowVector<Name> names;
+    CowVector<AnimalKind> kinds;
+    vector<shared_ptr<T>> views; // Grown as animal objects are created
+    // Treap links: children, subtree sizes and heap priorities per row.
+    CowVector<int> left, right, weight;
+    CowVector<uint32_t> priority;
+    CowVector<uint32_t> generation; // Bumped whenever the row is freed.
+    CowVector<long long> dueDay;    // Value of the day counter on which the row dies
+
+    CowVector<int> freeRows;
+    // Hashed timer wheel of deaths: a row is filed under its due day modulo the
+    // wheel size, and entries left behind by freed or rescheduled rows are dropped
+    // when their bucket comes round.
+    struct Timer {
+        int row;
+        uint32_t generation;
+        long long due;
+    };
+    static constexpr size_t wheelSize = 16;
+    array<CowVector<Timer>, wheelSize> wheel;
+    vector<int> pending;                  // Rows inserted but not linked into the tree yet
+    RowsByName rowsByName;                // Rows of each name id
+    size_t monsters = 0;                  // Rows holding a Monster
+    int root = -1;
+    uint32_t seed = 0x9E3779B9u;
+
+    uint32_t nextPriority() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    int allocRow() {
+        if (!freeRows.empty()) {
+            int r = freeRows.back();
+            freeRows.pop_back();
+            return r;
+        }
+        days.emplace_back();
+        names.emplace_back();
+        kinds.emplace_back();
+        left.emplace_back();
+        right.emplace_back();
+        weight.emplace_back();
+        priority.emplace_back();
+        generation.emplace_back();
+        dueDay.emplace_back();
+        return (int)days.size() - 1;
+    }
+
+    shared_ptr<T>& viewOf(int r) {
+        if (size_t(r) >= views.size())
+            views.resize(days.size());
+        return views[r];
+    }
+
+    // The animal object of a row, created if the row has none yet.
+    const shared_ptr<T>& view(int r) {
+        shared_ptr<T>& animal = viewOf(r);
+        if (!animal) {
+            animal = makeOfKind<T>(kinds[r], names[r], 0);
+            animal->bind(this, r);
+        }
+        return animal;
+    }
+
+    // Free an unlinked row and hand its animal back, unbound.
+    shared_ptr<T> release(int r) {
+        auto animal = view(r);
+        drop(r);
+        return animal;
+    }
+
+    // Free an unlinked row; an animal object viewing it keeps its last days.
+    void drop(int r) {
+        if (size_t(r) < views.size() && views[r]) {
+            views[r]->unbind();
+            views[r].reset();
+        }
+        countDays(days[r], -1);
+        rowsByName.remove(names[r].getId(), r);
+        monsters -= kinds[r] == AnimalKind::Monster;
+        ++generation.edit(r);
+        freeRows.push_back(r);
+    }
+
+    // Days lived as stored.
+    long long storedDays(int daysLived) const { return daysLived - day; }
+
+    // File a row under the PERIOD that kills it: the first one after which its
+    // days exceed 10, or 0 for a Monster, which therefore lives a single day.
+    long long dueOf(int r) const {
+        long long limit = kinds[r] == AnimalKind::Monster ? 0 : 10;
+        return max<long long>(day + 1, limit - days[r] + 1);
+    }
+
+    void schedule(int r) {
+        dueDay.edit(r) = dueOf(r);
+        wheel[size_t(dueDay[r]) % wheelSize].push_back({r, generation[r], dueDay[r]});
+    }
+
+    // Days set from outside (through an animal object) move the row's death.
+    void daysChanged(int r) override {
+        if (dueOf(r) != dueDay[r])
+            schedule(r);
+    }
+
+    int weightOf(int t) const { return t < 0 ? 0 : weight[t]; }
+    void update(int t) { weight.edit(t) = 1 + weightOf(left[t]) + weightOf(right[t]); }
+    bool less(int a, int b) const {
+        if (days[a] != days[b])
+            return days[a] < days[b];
+        return names[a] < names[b];
+    }
+
+    // Sort rows by (days, name), keeping equal keys in their order. Short lists
+    // use insertion sort; longer ones an LSD radix sort on the days and the 8-byte
+    // name prefix keys, after which only rows agreeing on both compare full names.
+    void sortRows(vector<int>& rows) const {
+        size_t n = rows.size();
+        if (n <= 32) {
+            for (size_t i = 1; i < n; i++) {
+                int r = rows[i];
+                size_t j = i;
+                for (; j > 0 && less(r, rows[j - 1]); j--)
+                    rows[j] = rows[j - 1];
+                rows[j] = r;
+            }
+            return;
+        }
+        struct Entry {
+            uint64_t key;  // Name prefix key
+            uint32_t days; // Days lived with the sign bit flipped, so they order as unsigned
+            int row;
+        };
+        vector<Entry> entries(n), scratch(n);
+        for (size_t i = 0; i < n; i++) {
+            int r = rows[i];
+            entries[i] = {names[r].getKey(), uint32_t(daysAt(r)) ^ 0x80000000u, r};
+        }
+        // One counting pass per byte, least significant first; a byte that is the
+        // same in every entry needs no pass.
+        auto pass = [&](auto digit) {
+            size_t count[256] = {};
+            for (const Entry& entry : entries)
+                ++count[digit(entry)];
+            if (count[digit(entries[0])] == n) return;
+            size_t offset = 0;
+            for (size_t& bucket : count)
+                offset += exchange(bucket, offset);
+            for (const Entry& entry : entries)
+                scratch[count[digit(entry)]++] = entry;
+            entries.swap(scratch);
+        };
+        for (int shift = 0; shift < 64; shift += 8)
+            pass([shift](const Entry& entry) { return uint8_t(entry.key >> shift); });
+        for (int shift = 0; shift < 32; shift += 8)
+            pass([shift](const Entry& entry) { return uint8_t(entry.days >> shift); });
+        for (size_t i = 0, j; i < n; i = j) {
+            for (j = i + 1; j < n && entries[j].days == entries[i].days && entries[j].key == entries[i].key; j++) {}
+            if (j - i > 1)
+                stable_sort(entries.begin() + i, entries.begin() + j,
+                            [this](const Entry& a, const Entry& b) { return names[a.row] < names[b.row]; });
+        }
+        for (size_t i = 0; i < n; i++)
+            rows[i] = entries[i].row;
+    }
+
+    // Split t into rows ordered before or equal to key (l) and after it (r).
+    void split(int t, int key, int& l, int& r) {
+        if (t < 0) { l = r = -1; return; }
+        if (less(key, t)) {
+            split(left[t], key, l, left.edit(t));
+            r = t;
+        } else {
+            split(right[t], key, right.edit(t), r);
+            l = t;
+        }
+        update(t);
+    }
+
+    int merge(int l, int r) {
+        if (l < 0) return r;
+        if (r < 0) return l;
+        if (priority[l] > priority[r]) {
+            right.edit(l) = merge(right[l], r);
+            update(l);
+            return l;
+        }
+        left.edit(r) = merge(l, left[r]);
+        update(r);
+        return r;
+    }
+
+    int insert(int t, int x) {
+        if (t < 0) return x;
+        if (priority[x] > priority[t]) {
+            split(t, x, left.edit(x), right.edit(x));
+            update(x);
+            return x;
+        }
+        if (less(x, t))
+            left.edit(t) = insert(left[t], x);
+        else
+            right.edit(t) = insert(right[t], x);
+        update(t);
+        return t;
+    }
+
+    int eraseAt(int t, int pos, int& removed) {
+        if (stats) ++stats->removeSteps;
+        int leftSize = weightOf(left[t]);
+        if (pos == leftSize) {
+            removed = t;
+            return merge(left[t], right[t]);
+        }
+        if (pos < leftSize)
+            left.edit(t) = eraseAt(left[t], pos, removed);
+        else
+            right.edit(t) = eraseAt(right[t], pos - leftSize - 1, removed);
+        update(t);
+        return t;
+    }
+
+    // Remove row x, located by its key; equal keys are searched on both sides.
+    int eraseRow(int t, int x, bool& found) {
+        if (t < 0) return t;
+        if (t == x) {
+            found = true;
+            return merge(left[t], right[t]);
+        }
+        if (!less(t, x))
+            left.edit(t) = eraseRow(left[t], x, found);
+        if (!found && !less(x, t))
+            right.edit(t) = eraseRow(right[t], x, found);
+        update(t);
+        return t;
+    }
+
+    // Position of row x within t (offset by the rows before t), located by its
+    // key like eraseRow; -1 if it is not there.
+    int rankOf(int t, int x, int offset) const {
+        if (t < 0) return -1;
+        int leftSize = weightOf(left[t]);
+        if (t == x) return offset + leftSize;
+        int found = -1;
+        if (!less(t, x))
+            found = rankOf(left[t], x, offset);
+        if (found < 0 && !less(x, t))
+            found = rankOf(right[t], x, offset + leftSize + 1);
+        return found;
+    }
+
+    // Number of rows whose stored days value is below the given one.
+    size_t rowsBelow(long long stored) const {
+        size_t count = 0;
+        for (int t = root; t >= 0;) {
+            if (days[t] < stored) {
+                count += weightOf(left[t]) + 1;
+                t = right[t];
+            } else {
+                t = left[t];
+            }
+        }
+        return count;
+    }
+
+    int rowAt(int pos) const {
+        int t = root;
+        while (true) {
+            int leftSize = weightOf(left[t]);
+            if (pos == leftSize) return t;
+            if (pos < leftSize) {
+                t = left[t];
+            } else {
+                pos -= leftSize + 1;
+                t = right[t];
+            }
+        }
+    }
+
+    // In-order traversal of the rows.
+    void collect(int t, vector<int>& order) const {
+        if (t < 0) return;
+        collect(left[t], order);
+        order.push_back(t);
+        collect(right[t], order);
+    }
+
+    // Build a treap from rows already in sorted order in O(n),
+    // using the usual stack construction of a Cartesian tree on priorities.
+    int build(const vector<int>& order) {
+        vector<int> stack;
+        for (int t : order) {
+            int last = -1;
+            while (!stack.empty() && priority[stack.back()] < priority[t]) {
+                last = stack.back();
+                stack.pop_back();
+            }
+            left.edit(t) = last;
+            right.edit(t) = -1;
+            if (!stack.empty())
+                right.edit(stack.back()) = t;
+            stack.push_back(t);
+        }
+        if (stack.empty()) return -1;
+        resize(stack.front());
+        return stack.front();
+    }
+
+    void resize(int t) {
+        if (t < 0) return;
+        resize(left[t]);
+        resize(right[t]);
+        update(t);
+    }
+};
+
+//-----------------------------------------------------
+// Cage container – allowed for birds and mice only.
+// It sorts the animals automatically upon addition.
+template <typename T>
+class Cage : public Container<T> {
+public:
+    void add(shared_ptr<T> animal) override {
+        this->insertSorted(animal);
+    }
+};
+
+// Specializations to disallow Cage for Fish and BetterFish.
+template <>
+class Cage<Fish> {
+public:
+    Cage() = delete;
+    Cage(const Cage<Fish>&) = delete;
+    Cage& operator=(const Cage<Fish>&) = delete;
+};
+
+template <>
 class Cage<BetterFish> {
 public:
     Cage() = delete;
@@ -261,8 +1630,7 @@ template <typename T>
 class Aquarium : public Container<T> {
 public:
     void add(shared_ptr<T> animal) override {
-        this->animals.push_back(animal);
-        this->reorder();
+        this->insertSorted(animal);
     }
 };
 
@@ -290,524 +1658,2697 @@ template <typename A>
 class Freedom : public Container<A> {
 public:
     void add(shared_ptr<A> animal) override {
-        this->animals.push_back(animal);
-        this->reorder();
+        this->insertSorted(animal);
     }
 };
 
-//-----------------------------------------------------
-// Global containers for each animal type.
-// These containers are pre-created according to the type of animal.
-map<string, shared_ptr<Animal>> allAnimals;
-Cage<Bird> cageBird;
-Cage<BetterBird> cageBetterBird;
-Cage<Mouse> cageMouse;
-Cage<BetterMouse> cageBetterMouse;
-Aquarium<Fish> aquariumFish;
-Aquarium<BetterFish> aquariumBetterFish;
-Aquarium<Mouse> aquariumMouse;
-Aquarium<BetterMouse> aquariumBetterMouse;
-Freedom<Animal> freedom;
-
 //-----------------------------------------------------
 // Helper function for updating a container during a PERIOD command.
-// For each animal in the container, increases daysLived by 1.
-// If the new days value exceeds 10, prints a death message and removes the animal.
-// Then, the container is completely re-ordered by extracting all animals and re-adding them.
+// Every animal in the container gets one more day (a single counter bump).
+// Animals whose days exceed 10, and Monsters, die; a death message is printed
+// for each of them in container order. The remaining order does not change.
 template <typename ContainerType>
 void periodUpdate(ContainerType &cont) {
-    int i = 0;
-    // Iterate over the container while updating days and possibly removing dead animals.
-    while(i < cont.size()){
-        auto animal = cont.getAnimalAt(i);
-        int newDays = animal->getDaysLived() + 1;
-        animal->setDaysLived(newDays);
-        // Special handling for Monster type animals:
-        if(animal->getType() == "MON"){
-            // Since Monster lives 1 day, if newDays > 0, it dies.
-            if(newDays > 0) {
-                cout << animal->getName() << " has died of old days" << endl;
-                cont.removeAtIndex(i);
-                continue; // Skip incrementing i to check new animal at this index.
-            }
-        }
-        // For any animal, if days exceed 10, the animal dies.
-        if(newDays > 10){
-            cout << animal->getName() << " has died of old days" << endl;
-            cont.removeAtIndex(i);
-        } else {
-            ++i;
-        }
-    }
-    // Rebuild the container by extracting all animals into a temporary vector
-    // and re-adding them (this ensures correct order).
-    vector<shared_ptr<Animal>> temp;
-    while(cont.size() > 0){
-        temp.push_back(cont.removeAtIndex(0));
-    }
-    for(auto &a : temp)
-        cont.addAnimal(a);
+    auto dead = cont.advanceDay();
+    if (stats) stats->deaths += dead.size();
+    for (const Name& name : dead)
+        out() << name.str() << " has died of old days" << '\n';
 }
 
 //-----------------------------------------------------
-// Main function: processes commands from the console.
-int main(){
-    ios::sync_with_stdio(false);
-    cin.tie(nullptr);
-
-    int C;
-    cin >> C;
-    string dummy;
-    getline(cin, dummy); // Skip the rest of the line after reading C.
-
-    // Process each command line by line.
-    for (int i = 0; i < C; i++) {
-        string line;
-        getline(cin, line);
-        istringstream iss(line);
-        string cmd;
-        iss >> cmd;
-
-        // CREATE <TYPE> <NAME> IN <CONTAINER> <N>
-        // Creates an animal of the given type with the provided name and days lived,
-        // and adds it to the specified container.
-        if(cmd == "CREATE"){
-            string typeCode, name, inToken, containerType;
-            int days;
-            iss >> typeCode >> name >> inToken >> containerType >> days;
-            shared_ptr<Animal> animal;
-            bool flag = false;
-            if(typeCode == "M")
-                animal = make_shared<Mouse>(name, days);
-            else if(typeCode == "F")
-                animal = make_shared<Fish>(name, days);
-            else if(typeCode == "B")
-                animal = make_shared<Bird>(name, days);
-            else if(typeCode == "BM")
-                animal = make_shared<BetterMouse>(name, days);
-            else if(typeCode == "BF")
-                animal = make_shared<BetterFish>(name, days);
-            else if(typeCode == "BB")
-                animal = make_shared<BetterBird>(name, days);
-
-            // Add the animal to the proper container.
-            if(containerType == "Cage"){
-                if(typeCode == "M"){
-                    cageMouse.addAnimal(animal);
-                    flag = true;
-                } 
-                else if(typeCode == "BM"){
-                    cageBetterMouse.addAnimal(animal);
-                    flag = true;
-                }  
-                else if(typeCode == "B") {
-                    cageBird.addAnimal(animal);
-                    flag = true;
-                }
-                else if(typeCode == "BB"){
-                    cageBetterBird.addAnimal(animal);
-                    flag = true;
-                }
+// Input reader
+// Hands out the input line by line without copying it. Regular files are
+// memory-mapped as a whole; pipes and terminals are read in large chunks.
+// A returned line stays valid until the next call to nextLine().
+class InputReader {
+public:
+    explicit InputReader(int fd) : fd(fd) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+                mapping = static_cast<const char*>(mapped);
+                data = mapping;
+                end = data + st.st_size;
+                eof = true;
             }
-            else if(containerType == "Aquarium"){
-                if(typeCode == "F") {
-                    aquariumFish.addAnimal(animal);
-                    flag = true;
-                }
-                else if(typeCode == "BF"){
-                    aquariumBetterFish.addAnimal(animal);
-                    flag = true;
-                }
-                else if(typeCode == "M"){
-                    aquariumMouse.addAnimal(animal);
-                    flag = true;
-                }
-                else if(typeCode == "BM"){
-                    aquariumBetterMouse.addAnimal(animal);
-                    flag = true;
-                }
+        }
+    }
+    InputReader(const InputReader&) = delete;
+    InputReader& operator=(const InputReader&) = delete;
+    ~InputReader() {
+        if (mapping)
+            munmap(const_cast<char*>(mapping), end - mapping);
+    }
+
+    // Return the next line without its terminating newline; false at end of input.
+    bool nextLine(string_view& line) {
+        while (true) {
+            const char* newline = static_cast<const char*>(memchr(data, '\n', end - data));
+            if (newline) {
+                line = string_view(data, newline - data);
+                data = newline + 1;
+                return true;
             }
-            else if(containerType == "Freedom"){
-                freedom.addAnimal(animal);
-                flag = true;
-            }
-            if(flag) animal->talk(); // Print the animal info after creation.
-        }
-        // APPLY_SUBSTANCE <CONTAINER> <TYPE> <POS>
-        // Applies the substance to the animal at the given position in the specified container.
-        // If applied to a normal animal, it transforms into the "better" version.
-        // If applied to an already "better" animal, it becomes a Monster (and clears the container).
-        else if(cmd == "APPLY_SUBSTANCE"){
-            string containerType;
-            iss >> containerType;
-            if(containerType == "Freedom"){
-                int pos;
-                iss >> pos;
-                cout << "Substance cannot be applied in freedom" << endl;
-            } else {
-                string typeCode;
-                int pos;
-                iss >> typeCode >> pos;
-                try{
-                    if(containerType == "Cage"){
-                        if(typeCode == "M"){
-                            auto animal = cageMouse.getAnimalAt(pos);
-                            string curType = animal->getType();
-                            if(curType == "M"){
-                                // Transform Mouse to BetterMouse.
-                                Mouse* mPtr = dynamic_cast<Mouse*>(animal.get());
-                                auto better = make_shared<BetterMouse>(*mPtr);
-                                cageMouse.removeAtIndex(pos);
-                                cageBetterMouse.addAnimal(better);
-                            } else if(curType == "BM"){
-                                // If substance applied second time, transform BetterMouse to Monster.
-                                auto monster = make_shared<Monster>(*animal);
-                                cageBetterMouse.removeAtIndex(pos);
-                                // Remove all animals from the BetterMouse container, printing death messages.
-                                while(cageBetterMouse.size() > 0){
-                                    auto a = cageBetterMouse.removeAtIndex(0);
-                                    // (Note: death messages can be printed here if required by the spec)
-                                }
-                                freedom.addAnimal(monster);
-                            }
-                        }
-                        else if(typeCode == "B"){
-                            auto animal = cageBird.getAnimalAt(pos);
-                            string curType = animal->getType();
-                            if(curType == "B"){
-                                // Transform Bird to BetterBird.
-                                Bird* bPtr = dynamic_cast<Bird*>(animal.get());
-                                auto better = make_shared<BetterBird>(*bPtr);
-                                cageBird.removeAtIndex(pos);
-                                cageBetterBird.addAnimal(better);
-                            } else if(curType == "BB"){
-                                // Transform BetterBird to Monster.
-                                auto monster = make_shared<Monster>(*animal);
-                                cageBetterBird.removeAtIndex(pos);
-                                while(cageBetterBird.size() > 0){
-                                    auto a = cageBetterBird.removeAtIndex(0);
-                                }
-                                freedom.addAnimal(monster);
-                            }
-                        }
-                        else if(typeCode == "BM"){
-                            auto animal = cageBetterMouse.getAnimalAt(pos);
-                            string curType = animal->getType();
-                            if(curType == "BM"){
-                                // Transform BetterMouse to Monster.
-                                auto monster = make_shared<Monster>(*animal);
-                                cageBetterMouse.removeAtIndex(pos);
-                                while(cageBetterMouse.size() > 0){
-                                    auto a = cageBetterMouse.removeAtIndex(0);
-                                }
-                                freedom.addAnimal(monster);
-                            }
-                        }
-                        else if(typeCode == "BB"){
-                            auto animal = cageBetterBird.getAnimalAt(pos);
-                            string curType = animal->getType();
-                            if(curType == "BB"){
-                                // Transform BetterBird to Monster.
-                                auto monster = make_shared<Monster>(*animal);
-                                cageBetterBird.removeAtIndex(pos);
-                                while(cageBetterBird.size() > 0){
-                                    auto a = cageBetterBird.removeAtIndex(0);
-                                }
-                                freedom.addAnimal(monster);
-                            }
-                        }
-                    }
-                    else if(containerType == "Aquarium"){
-                        if(typeCode == "F"){
-                            auto animal = aquariumFish.getAnimalAt(pos);
-                            string curType = animal->getType();
-                            if(curType == "F"){
-                                // Transform Fish to BetterFish.
-                                Fish* fPtr = dynamic_cast<Fish*>(animal.get());
-                                auto better = make_shared<BetterFish>(*fPtr);
-                                aquariumFish.removeAtIndex(pos);
-                                aquariumBetterFish.addAnimal(better);
-                            } else if(curType == "BF"){
-                                // Transform BetterFish to Monster.
-                                auto monster = make_shared<Monster>(*animal);
-                                aquariumBetterFish.removeAtIndex(pos);
-                                while(aquariumBetterFish.size() > 0){
-                                    auto a = aquariumBetterFish.removeAtIndex(0);
-                                }
-                                freedom.addAnimal(monster);
-                            }
-                        }
-                        else if(typeCode == "M"){
-                            auto animal = aquariumMouse.getAnimalAt(pos);
-                            string curType = animal->getType();
-                            if(curType == "M"){
-                                // Transform Mouse to BetterMouse.
-                                Mouse* mPtr = dynamic_cast<Mouse*>(animal.get());
-                                auto better = make_shared<BetterMouse>(*mPtr);
-                                aquariumMouse.removeAtIndex(pos);
-                                aquariumBetterMouse.addAnimal(better);
-                            } else if(curType == "BM"){
-                                // Transform BetterMouse to Monster.
-                                auto monster = make_shared<Monster>(*animal);
-                                aquariumBetterMouse.removeAtIndex(pos);
-                                while(aquariumBetterMouse.size() > 0){
-                                    auto a = aquariumBetterMouse.removeAtIndex(0);
-                                }
-                                freedom.addAnimal(monster);
-                            }
-                        }
-                        else if(typeCode == "BF"){
-                            auto animal = aquariumBetterFish.getAnimalAt(pos);
-                            string curType = animal->getType();
-                            if(curType == "BF"){
-                                // Transform BetterFish to Monster.
-                                auto monster = make_shared<Monster>(*animal);
-                                aquariumBetterFish.removeAtIndex(pos);
-                                while(aquariumBetterFish.size() > 0){
-                                    auto a = aquariumBetterFish.removeAtIndex(0);
-                                }
-                                freedom.addAnimal(monster);
-                            }
-                        }
-                        else if(typeCode == "BM"){
-                            auto animal = aquariumBetterMouse.getAnimalAt(pos);
-                            string curType = animal->getType();
-                            if(curType == "BM"){
-                                // Transform BetterMouse to Monster.
-                                auto monster = make_shared<Monster>(*animal);
-                                aquariumBetterMouse.removeAtIndex(pos);
-                                while(aquariumBetterMouse.size() > 0){
-                                    auto a = aquariumBetterMouse.removeAtIndex(0);
-                                }
-                                freedom.addAnimal(monster);
-                            }
-                        }
-                    }
-                }
-                catch(const out_of_range &e){
-                    cout << "Animal not found" << endl;
-                }
+            if (eof) {
+                if (data == end) return false;
+                line = string_view(data, end - data);
+                data = end;
+                return true;
             }
+            refill();
         }
-        // REMOVE_SUBSTANCE <CONTAINER> <TYPE> <POS>
-        // Removes the substance from an animal.
-        // For "better" animals, this doubles the days lived.
-        // If the resulting days exceed 10, the animal dies.
-        else if(cmd == "REMOVE_SUBSTANCE"){
-            string containerType;
-            iss >> containerType;
-            if(containerType == "Freedom"){
-                int pos;
-                iss >> pos;
-                cout << "Substance cannot be removed in freedom" << endl;
-            } else {
-                string typeCode;
-                int pos;
-                iss >> typeCode >> pos;
-                try{
-                    if(containerType == "Cage"){
-                        if(typeCode == "BM"){
-                            auto animal = cageBetterMouse.getAnimalAt(pos);
-                            int newDays = animal->getDaysLived() * 2;
-                            auto normal = make_shared<Mouse>(animal->getName(), newDays);
-                            cageBetterMouse.removeAtIndex(pos);
-                            cageMouse.addAnimal(normal);
-                        }
-                        else if(typeCode == "BB"){
-                            auto animal = cageBetterBird.getAnimalAt(pos);
-                            int newDays = animal->getDaysLived() * 2;
-                            auto normal = make_shared<Bird>(animal->getName(), newDays);
-                            cageBetterBird.removeAtIndex(pos);
-                            cageBird.addAnimal(normal);
-                        }
-                        else{
-                            cout << "Invalid substance removal" << endl;
-                        }
-                    }
-                    else if(containerType == "Aquarium"){
-                        if(typeCode == "BF"){
-                            auto animal = aquariumBetterFish.getAnimalAt(pos);
-                            int newDays = animal->getDaysLived() * 2;
-                            auto normal = make_shared<Fish>(animal->getName(), newDays);
-                            aquariumBetterFish.removeAtIndex(pos);
-                            aquariumFish.addAnimal(normal);
-                        }
-                        else if(typeCode == "BM"){
-                            auto animal = aquariumBetterMouse.getAnimalAt(pos);
-                            int newDays = animal->getDaysLived() * 2;
-                            auto normal = make_shared<Mouse>(animal->getName(), newDays);
-                            aquariumBetterMouse.removeAtIndex(pos);
-                            aquariumMouse.addAnimal(normal);
-                        }
-                        else{
-                            cout << "Invalid substance removal" << endl;
-                        }
-                    }
-                }
-                catch(const out_of_range &e){
-                    cout << "Animal not found" << endl;
-                }
-            }
+    }
+
+private:
+    static constexpr size_t chunkSize = 1 << 20;
+
+    // Keep the unread tail of the buffer and append the next chunk after it.
+    void refill() {
+        size_t kept = end - data;
+        if (kept && data != buffer.data())
+            memmove(buffer.data(), data, kept);
+        if (buffer.size() < kept + chunkSize)
+            buffer.resize(kept + chunkSize);
+        ssize_t got;
+        do {
+            got = read(fd, buffer.data() + kept, buffer.size() - kept);
+        } while (got < 0 && errno == EINTR);
+        if (got <= 0) {
+            eof = true;
+            got = 0;
         }
-        // ATTACK <CONTAINER> <TYPE> <POS1> <POS2>
-        // Makes the animal at POS1 attack the animal at POS2.
-        // Both animals must be in the same container.
-        else if(cmd == "ATTACK"){
-            string containerType;
-            iss >> containerType;
-            if(containerType == "Freedom"){
-                int pos1, pos2;
-                iss >> pos1 >> pos2;
-                cout << "Animals cannot attack in Freedom" << endl;
-            } else {
-                string typeCode;
-                int pos1, pos2;
-                iss >> typeCode >> pos1 >> pos2;
-                if(pos1 == pos2) continue; // Prevent self-attack.
-                try{
-                    if(containerType == "Cage"){
-                        if(typeCode == "M"){
-                            auto attacker = cageMouse.getAnimalAt(pos1);
-                            auto defender = cageMouse.getAnimalAt(pos2);
-                            attacker->attack(*defender);
-                            if(defender->getDaysLived() == 11)
-                                cageMouse.removeAtIndex(pos2);
-                        }
-                        else if(typeCode == "B"){
-                            auto attacker = cageBird.getAnimalAt(pos1);
-                            auto defender = cageBird.getAnimalAt(pos2);
-                            attacker->attack(*defender);
-                            if(defender->getDaysLived() == 11)
-                                cageBird.removeAtIndex(pos2);
-                        }
-                        else if(typeCode == "BM"){
-                            auto attacker = cageBetterMouse.getAnimalAt(pos1);
-                            auto defender = cageBetterMouse.getAnimalAt(pos2);
-                            attacker->attack(*defender);
-                            if(defender->getDaysLived() == 11)
-                                cageBetterMouse.removeAtIndex(pos2);
-                        }
-                        else if(typeCode == "BB"){
-                            auto attacker = cageBetterBird.getAnimalAt(pos1);
-                            auto defender = cageBetterBird.getAnimalAt(pos2);
-                            attacker->attack(*defender);
-                            if(defender->getDaysLived() == 11)
-                                cageBetterBird.removeAtIndex(pos2);
-                        }
-                    }
-                    else if(containerType == "Aquarium"){
-                        if(typeCode == "F"){
-                            auto attacker = aquariumFish.getAnimalAt(pos1);
-                            auto defender = aquariumFish.getAnimalAt(pos2);
-                            attacker->attack(*defender);
-                            if(defender->getDaysLived() == 11)
-                                aquariumFish.removeAtIndex(pos2);
-                        }
-                        else if(typeCode == "BF"){
-                            auto attacker = aquariumBetterFish.getAnimalAt(pos1);
-                            auto defender = aquariumBetterFish.getAnimalAt(pos2);
-                            attacker->attack(*defender);
-                            if(defender->getDaysLived() == 11)
-                                aquariumBetterFish.removeAtIndex(pos2);
-                        }
-                        else if(typeCode == "M"){
-                            auto attacker = aquariumMouse.getAnimalAt(pos1);
-                            auto defender = aquariumMouse.getAnimalAt(pos2);
-                            attacker->attack(*defender);
-                            if(defender->getDaysLived() == 11)
-                                aquariumMouse.removeAtIndex(pos2);
-                        }
-                        else if(typeCode == "BM"){
-                            auto attacker = aquariumBetterMouse.getAnimalAt(pos1);
-                            auto defender = aquariumBetterMouse.getAnimalAt(pos2);
-                            attacker->attack(*defender);
-                            if(defender->getDaysLived() == 11)
-                                aquariumBetterMouse.removeAtIndex(pos2);
-                        }
-                    }
-                }
-                catch(const out_of_range &e){
-                    cout << "Animal not found" << endl;
-                }
-            }
+        data = buffer.data();
+        end = data + kept + got;
+    }
+
+    int fd;
+    const char* mapping = nullptr;
+    vector<char> buffer;
+    const char* data = nullptr;
+    const char* end = nullptr;
+    bool eof = false;
+};
+
+//-----------------------------------------------------
+// Tokenizer for a single command line.
+// Reads words and integers the way an istringstream would, but in place:
+// a failed integer read yields 0 and makes every following read fail too.
+class LineTokens {
+public:
+    explicit LineTokens(string_view line) : cur(line.data()), end(line.data() + line.size()) {}
+
+    LineTokens& operator>>(string_view& word) {
+        skipSpace();
+        if (failed || cur == end) {
+            failed = true;
+            return *this;
         }
-        // TALK <CONTAINER> <TYPE> <POS> or TALK Freedom <POS>
-        // Prints the information of the animal at the specified position.
-        else if(cmd == "TALK"){
-            string containerType;
-            iss >> containerType;
-            if(containerType == "Freedom"){
-                int pos;
-                iss >> pos;
-                try{
-                    auto animal = freedom.getAnimalAt(pos);
-                    animal->talk();
-                }
-                catch(const out_of_range &e){
-                    cout << "Animal not found" << endl;
-                }
-            } else {
-                string typeCode;
-                int pos;
-                iss >> typeCode >> pos;
-                try{
-                    if(containerType == "Cage"){
-                        if(typeCode == "M"){
-                            auto animal = cageMouse.getAnimalAt(pos);
-                            animal->talk();
-                        }
-                        else if(typeCode == "BM"){
-                            auto animal = cageBetterMouse.getAnimalAt(pos);
-                            animal->talk();
-                        }
-                        else if(typeCode == "B"){
-                            auto animal = cageBird.getAnimalAt(pos);
-                            animal->talk();
-                        }
-                        else if(typeCode == "BB"){
-                            auto animal = cageBetterBird.getAnimalAt(pos);
-                            animal->talk();
-                        }
-                    }
-                    else if(containerType == "Aquarium"){
-                        if(typeCode == "F"){
-                            auto animal = aquariumFish.getAnimalAt(pos);
-                            animal->talk();
-                        }
-                        else if(typeCode == "BF"){
-                            auto animal = aquariumBetterFish.getAnimalAt(pos);
-                            animal->talk();
-                        }
-                        else if(typeCode == "M"){
-                            auto animal = aquariumMouse.getAnimalAt(pos);
-                            animal->talk();
-                        }
-                        else if(typeCode == "BM"){
-                            auto animal = aquariumBetterMouse.getAnimalAt(pos);
-                            animal->talk();
-                        }
-                    }
-                }
-                catch(const out_of_range &e){
-                    cout << "Animal not found" << endl;
-                }
-            }
+        const char* start = cur;
+        while (cur != end && !isSpace(*cur)) ++cur;
+        word = string_view(start, cur - start);
+        return *this;
+    }
+
+    LineTokens& operator>>(string& word) {
+        string_view view;
+        if (*this >> view, !failed)
+            word.assign(view.data(), view.size());
+        return *this;
+    }
+
+    // Whether every read so far succeeded.
+    explicit operator bool() const { return !failed; }
+
+    LineTokens& operator>>(int& value) {
+        skipSpace();
+        value = 0;
+        if (failed) return *this;
+        const char* start = cur;
+        if (start != end && *start == '+' && start + 1 != end && *(start + 1) != '-') ++start;
+        auto [ptr, ec] = from_chars(start, end, value);
+        if (ec == errc::result_out_of_range) {
+            value = *start == '-' ? INT_MIN : INT_MAX;
+            failed = true;
+        } else if (ec != errc()) {
+            failed = true;
+            return *this;
+        }
+        cur = ptr;
+        return *this;
+    }
+
+private:
+    static bool isSpace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+    void skipSpace() { while (cur != end && isSpace(*cur)) ++cur; }
+
+    const char* cur;
+    const char* end;
+    bool failed = false;
+};
+
+//-----------------------------------------------------
+// Command vocabulary
+// Every token that selects behaviour is parsed once into a small enum.
+enum class Command : uint8_t {
+    Create, ApplySubstance, RemoveSubstance, Attack, Talk, Period, Count, Histogram, TopK, Range,
+    ApplySubstanceByName, RemoveSubstanceByName, AttackByName, TalkByName, Unknown};
+enum class Place : uint8_t { Cage, Aquarium, Freedom, Unknown };
+
+constexpr size_t placeCount = 4;
+
+constexpr const char* commandNames[] = {
+    "CREATE", "APPLY_SUBSTANCE", "REMOVE_SUBSTANCE", "ATTACK", "TALK", "PERIOD",
+    "COUNT", "HISTOGRAM", "TOPK", "RANGE",
+    "APPLY_SUBSTANCE_BY_NAME", "REMOVE_SUBSTANCE_BY_NAME", "ATTACK_BY_NAME", "TALK_BY_NAME", "other"};
+constexpr size_t commandCount = size_t(Command::Unknown) + 1;
+
+Command parseCommand(string_view token) {
+    if (token == "CREATE") return Command::Create;
+    if (token == "APPLY_SUBSTANCE") return Command::ApplySubstance;
+    if (token == "REMOVE_SUBSTANCE") return Command::RemoveSubstance;
+    if (token == "ATTACK") return Command::Attack;
+    if (token == "TALK") return Command::Talk;
+    if (token == "PERIOD") return Command::Period;
+    if (token == "COUNT") return Command::Count;
+    if (token == "HISTOGRAM") return Command::Histogram;
+    if (token == "TOPK") return Command::TopK;
+    if (token == "RANGE") return Command::Range;
+    if (token == "APPLY_SUBSTANCE_BY_NAME") return Command::ApplySubstanceByName;
+    if (token == "REMOVE_SUBSTANCE_BY_NAME") return Command::RemoveSubstanceByName;
+    if (token == "ATTACK_BY_NAME") return Command::AttackByName;
+    if (token == "TALK_BY_NAME") return Command::TalkByName;
+    return Command::Unknown;
+}
+
+Place parsePlace(string_view token) {
+    if (token == "Cage") return Place::Cage;
+    if (token == "Aquarium") return Place::Aquarium;
+    if (token == "Freedom") return Place::Freedom;
+    return Place::Unknown;
+}
+
+// Animal classes in AnimalKind order, and the kind a substance turns each kind into.
+using KindTypes = tuple<Mouse, Fish, Bird, BetterMouse, BetterFish, BetterBird>;
+constexpr AnimalKind betterKind[kindCount] = {
+    AnimalKind::BetterMouse, AnimalKind::BetterFish, AnimalKind::BetterBird,
+    AnimalKind::Unknown, AnimalKind::Unknown, AnimalKind::Unknown, AnimalKind::Unknown, AnimalKind::Unknown};
+constexpr AnimalKind normalKind[kindCount] = {
+    AnimalKind::Unknown, AnimalKind::Unknown, AnimalKind::Unknown,
+    AnimalKind::Mouse, AnimalKind::Fish, AnimalKind::Bird, AnimalKind::Unknown, AnimalKind::Unknown};
+
+//-----------------------------------------------------
+// Container registry
+// The containers of a world, in the order a PERIOD visits them. A (place, kind)
+// pair resolves to a slot in this list through a table computed at compile time:
+// a kind has a slot in Cage or Aquarium only if that container template can be
+// instantiated for it, so the deleted specializations (Cage<Fish>, Aquarium<Bird>, ...)
+// show up as missing entries. Freedom takes every kind into its single slot.
+using WorldContainers = tuple<Cage<Bird>, Cage<BetterBird>, Cage<Mouse>, Cage<BetterMouse>,
+                              Aquarium<Fish>, Aquarium<BetterFish>, Aquarium<Mouse>, Aquarium<BetterMouse>,
+                              Freedom<Animal>>;
+constexpr size_t slotCount = tuple_size_v<WorldContainers>;
+constexpr const char* slotNames[slotCount] = {
+    "Cage<Bird>", "Cage<BetterBird>", "Cage<Mouse>", "Cage<BetterMouse>",
+    "Aquarium<Fish>", "Aquarium<BetterFish>", "Aquarium<Mouse>", "Aquarium<BetterMouse>",
+    "Freedom<Animal>"};
+constexpr int noSlot = -1;
+
+// Index of container type C in WorldContainers, or noSlot.
+template <typename C, size_t I = 0>
+constexpr int slotIndex() {
+    if constexpr (I == slotCount)
+        return noSlot;
+    else if constexpr (is_same_v<C, tuple_element_t<I, WorldContainers>>)
+        return I;
+    else
+        return slotIndex<C, I + 1>();
+}
+
+template <template <typename> class Box, typename T>
+constexpr int slotOf() {
+    if constexpr (is_default_constructible_v<Box<T>>)
+        return slotIndex<Box<T>>();
+    else
+        return noSlot;
+}
+
+constexpr array<int8_t, kindCount> uniformRow(int slot) {
+    array<int8_t, kindCount> row{};
+    for (auto& entry : row)
+        entry = int8_t(slot);
+    return row;
+}
+
+template <template <typename> class Box, size_t... K>
+constexpr array<int8_t, kindCount> placeRow(index_sequence<K...>) {
+    array<int8_t, kindCount> row = uniformRow(noSlot);
+    ((row[K] = int8_t(slotOf<Box, tuple_element_t<K, KindTypes>>())), ...);
+    return row;
+}
+
+constexpr array<array<int8_t, kindCount>, placeCount> slotTable = {{
+    placeRow<Cage>(make_index_sequence<tuple_size_v<KindTypes>>()),
+    placeRow<Aquarium>(make_index_sequence<tuple_size_v<KindTypes>>()),
+    uniformRow(slotOf<Freedom, Animal>()),
+    uniformRow(noSlot),
+}};
+
+constexpr int slotFor(Place place, AnimalKind kind) {
+    return slotTable[size_t(place)][size_t(kind)];
+}
+
+constexpr int freedomSlot = slotOf<Freedom, Animal>();
+constexpr uint32_t allSlots = (1u << slotCount) - 1;
+
+// Containers a query covers, as bits: the container of a place and type, every
+// container of the place when no type is given, or every container when no
+// known place is given.
+constexpr uint32_t slotsSelected(Place place, AnimalKind kind) {
+    if (place == Place::Unknown) return allSlots;
+    if (slotFor(place, kind) != noSlot) return 1u << slotFor(place, kind);
+    if (kind != AnimalKind::Unknown) return 0;
+    uint32_t slots = 0;
+    for (size_t k = 0; k < kindCount; k++)
+        if (slotFor(place, AnimalKind(k)) != noSlot)
+            slots |= 1u << slotFor(place, AnimalKind(k));
+    return slots;
+}
+
+static_assert(slotFor(Place::Cage, AnimalKind::Fish) == noSlot, "Cage<Fish> is disallowed");
+static_assert(slotFor(Place::Aquarium, AnimalKind::BetterBird) == noSlot, "Aquarium<BetterBird> is disallowed");
+static_assert(slotFor(Place::Aquarium, AnimalKind::Mouse) == slotIndex<Aquarium<Mouse>>(), "");
+
+// The place and a type of each container, for commands that find an animal by
+// name; for Freedom the type is the first one it takes, as Freedom ignores types.
+template <typename Field>
+constexpr array<Field, slotCount> slotInverse(Field (*field)(Place, AnimalKind)) {
+    array<Field, slotCount> fields{};
+    for (size_t p = placeCount; p-- > 0;)
+        for (size_t k = kindCount; k-- > 0;)
+            if (slotFor(Place(p), AnimalKind(k)) != noSlot)
+                fields[slotFor(Place(p), AnimalKind(k))] = field(Place(p), AnimalKind(k));
+    return fields;
+}
+constexpr array<Place, slotCount> slotPlace = slotInverse<Place>([](Place p, AnimalKind) { return p; });
+constexpr array<AnimalKind, slotCount> slotKind = slotInverse<AnimalKind>([](Place, AnimalKind k) { return k; });
+
+//-----------------------------------------------------
+// Decoded commands
+// A command line reduced to enums, an interned name and integers, ready to be
+// executed by a world. Fields a command does not use, or that failed to parse,
+// stay Unknown, empty or 0, as the stream-style parsing used to leave them.
+struct CommandRecord {
+    Command command = Command::Unknown;
+    Place place = Place::Unknown;
+    AnimalKind kind = AnimalKind::Unknown;
+    Name name;    // Name of the new animal (CREATE), or of the animal (the attacker's for ATTACK_BY_NAME)
+    Name other;   // Name of the defender (ATTACK_BY_NAME)
+    int days = 0; // Days lived of the new animal (CREATE)
+    int pos = 0;  // Position in the container (the attacker's for ATTACK; k for TOPK; low end for RANGE;
+                  // days for PERIOD)
+    int pos2 = 0; // Position of the defender (ATTACK; high end for RANGE)
+    bool unmatched = false; // A query names a container or type that does not exist
+};
+
+// Containers a query covers: none if it names a container or type that does not exist.
+inline uint32_t slotsSelected(const CommandRecord& record) {
+    return record.unmatched ? 0 : slotsSelected(record.place, record.kind);
+}
+
+CommandRecord parseCommandLine(string_view line) {
+    LineTokens tokens(line);
+    string_view cmd, typeCode, name, inToken, containerType;
+    CommandRecord record;
+    tokens >> cmd;
+    record.command = parseCommand(cmd);
+    switch (record.command) {
+    case Command::Create:
+        tokens >> typeCode >> name >> inToken >> containerType >> record.days;
+        record.kind = parseKind(typeCode);
+        record.place = parsePlace(containerType);
+        record.name = Name(name);
+        break;
+    case Command::ApplySubstance:
+    case Command::RemoveSubstance:
+    case Command::Attack:
+    case Command::Talk:
+        // <CONTAINER> [<TYPE>] <POS> [<POS2>]; Freedom takes no type.
+        tokens >> containerType;
+        record.place = parsePlace(containerType);
+        if (record.place != Place::Freedom) {
+            tokens >> typeCode;
+            record.kind = parseKind(typeCode);
         }
-        // PERIOD command: Adds +1 day to every animal.
-        // This command increases each animal's age; if an animal's age exceeds 10, it dies.
-        // After processing, the container is rebuilt (to maintain sorted order).
-        else if(cmd == "PERIOD"){
-            periodUpdate(cageBird);
-            periodUpdate(cageBetterBird);
-            periodUpdate(cageMouse);
-            periodUpdate(cageBetterMouse);
-            periodUpdate(aquariumFish);
-            periodUpdate(aquariumBetterFish);
-            periodUpdate(aquariumMouse);
-            periodUpdate(aquariumBetterMouse);
-            periodUpdate(freedom);
+        tokens >> record.pos;
+        if (record.command == Command::Attack)
+            tokens >> record.pos2;
+        break;
+    case Command::Period:
+        // [<K>]; without a readable count, one day.
+        tokens >> record.pos;
+        if (!tokens && record.pos == 0)
+            record.pos = 1;
+        break;
+    case Command::Count:
+    case Command::Histogram:
+    case Command::TopK:
+    case Command::Range:
+        // [<K> | <LOW> <HIGH>] [<CONTAINER> [<TYPE>]]
+        if (record.command == Command::TopK)
+            tokens >> record.pos;
+        if (record.command == Command::Range)
+            tokens >> record.pos >> record.pos2;
+        tokens >> containerType >> typeCode;
+        record.place = parsePlace(containerType);
+        if (record.place != Place::Freedom)
+            record.kind = parseKind(typeCode);
+        record.unmatched = (!containerType.empty() && record.place == Place::Unknown)
+                        || (!typeCode.empty() && record.place != Place::Freedom && record.kind == AnimalKind::Unknown);
+        break;
+    case Command::ApplySubstanceByName:
+    case Command::RemoveSubstanceByName:
+    case Command::AttackByName:
+    case Command::TalkByName:
+        // <NAME> [<NAME2>]
+        tokens >> name;
+        record.name = Name(name);
+        if (record.command == Command::AttackByName) {
+            tokens >> name;
+            record.other = Name(name);
         }
+        break;
+    default:
+        break;
     }
-    
-    return 0;
+    return record;
+}
+
+//-----------------------------------------------------
+// World
+// Owns one set of containers and executes commands against them.
+// Several worlds can exist side by side in one process.
+class World {
+public:
+    World() {
+        apply([this](auto&... containers) { slots = {{ &containers... }}; }, containers);
+    }
+    World(const World&) = delete;
+    World& operator=(const World&) = delete;
+
+    IContainer& container(int slot) { return *slots[slot]; }
+
+    // Table of the names in this world; commands for it are read under a NameScope of it.
+    NameTable& nameTable() { return *names; }
+
+    // A new world holding the same animals, which shares the containers' storage
+    // page by page until one of the two writes to it; from then on the two are
+    // independent and can run on different threads. The copy starts with no
+    // commands run. Forking costs a page table copy per column, not a copy of
+    // the animals.
+    unique_ptr<World> fork() {
+        auto copy = make_unique<World>();
+        copy->names = names;
+        for (size_t slot = 0; slot < slotCount; slot++)
+            copy->slots[slot]->forkFrom(*slots[slot]);
+        return copy;
+    }
+
+    // Parse and execute one command line; its names go to this world's table.
+    void execute(string_view line) {
+        NameScope scope(*names);
+        run(parseCommandLine(line));
+    }
+
+    // Execute one decoded command, which stands for the given number of input
+    // commands (several PERIODs run as one).
+    void run(const CommandRecord& record, uint64_t commands = 1) {
+        if (stats)
+            runTimed(record);
+        else
+            dispatch(record);
+        countRun(commands);
+    }
+
+    // Execute one decoded command, without timing or counting it. Commands
+    // touching different containers may be dispatched from different threads.
+    void dispatch(const CommandRecord& record) { (this->*handlers[size_t(record.command)])(record); }
+
+    // Number of commands executed, counting those before a restored snapshot.
+    uint64_t commandsRun() const { return executed; }
+    void resumeAt(uint64_t commands) { executed = commands; }
+    // Count commands that have been run, and write a checkpoint if one fell due.
+    void countRun(uint64_t commands) {
+        uint64_t before = executed;
+        executed += commands;
+        if (checkpointEvery && executed / checkpointEvery != before / checkpointEvery)
+            checkpoint();
+    }
+
+    // Write a snapshot to path after every `every` commands (0: only on request).
+    void checkpointTo(string path, uint64_t every) {
+        checkpointPath = move(path);
+        checkpointEvery = every;
+    }
+    // Write the snapshot now, once the output so far has been written out.
+    bool checkpoint();
+
+private:
+    using Handler = void (World::*)(const CommandRecord&);
+    static const Handler handlers[];
+
+    void runTimed(const CommandRecord& record) {
+        int target = targetOf(record);
+        uint64_t start = nowNanos();
+        (this->*handlers[size_t(record.command)])(record);
+        uint64_t elapsed = nowNanos() - start;
+        stats->commands[size_t(record.command)].record(elapsed);
+        if (target != noSlot)
+            stats->containers[target].record(elapsed);
+        for (size_t slot = 0; slot < slotCount; slot++)
+            stats->peakSize[slot] = max(stats->peakSize[slot], slots[slot]->size());
+    }
+
+    // CREATE <TYPE> <NAME> IN <CONTAINER> <N>
+    // Creates an animal of the given type with the provided name and days lived,
+    // and adds it to the specified container.
+    void create(const CommandRecord& record) {
+        int slot = slotFor(record.place, record.kind);
+        if (slot == noSlot) return;
+        slots[slot]->addNew(record.kind, record.name, record.days);
+        Animal::talk(record.name, record.days); // Print the animal info after creation.
+    }
+
+    // APPLY_SUBSTANCE <CONTAINER> <TYPE> <POS>
+    // Applies the substance to the animal at the given position in the specified container.
+    // If applied to a normal animal, it transforms into the "better" version.
+    // If applied to an already "better" animal, it becomes a Monster (and clears the container).
+    void applySubstance(const CommandRecord& record) {
+        if (record.place == Place::Freedom) {
+            out() << "Substance cannot be applied in freedom" << '\n';
+            return;
+        }
+        int slot = slotFor(record.place, record.kind);
+        if (slot == noSlot) return;
+        int pos = record.pos;
+        try {
+            AnimalRecord animal = slots[slot]->recordAt(pos);
+            AnimalKind better = betterKind[size_t(record.kind)];
+            if (better != AnimalKind::Unknown) {
+                // Transform the animal into its better version.
+                slots[slot]->discardAt(pos);
+                slots[slotFor(record.place, better)]->addNew(better, animal.name, betterDays(animal.days));
+            } else {
+                // Substance applied a second time: the animal becomes a Monster,
+                // leaves for freedom, and the rest of its container is cleared.
+                if (stats) ++stats->monsterConversions;
+                slots[slot]->discardAt(pos);
+                slots[slot]->clear();
+                slots[freedomSlot]->addNew(AnimalKind::Monster, animal.name, monsterDays);
+            }
+        }
+        catch (const out_of_range&) {
+            out() << "Animal not found" << '\n';
+        }
+    }
+
+    // REMOVE_SUBSTANCE <CONTAINER> <TYPE> <POS>
+    // Removes the substance from an animal.
+    // For "better" animals, this turns them back into normal ones with doubled days lived.
+    void removeSubstance(const CommandRecord& record) {
+        if (record.place == Place::Freedom) {
+            out() << "Substance cannot be removed in freedom" << '\n';
+            return;
+        }
+        if (record.place == Place::Unknown) return;
+        int slot = slotFor(record.place, record.kind);
+        AnimalKind normal = normalKind[size_t(record.kind)];
+        if (slot == noSlot || normal == AnimalKind::Unknown) {
+            out() << "Invalid substance removal" << '\n';
+            return;
+        }
+        try {
+            AnimalRecord animal = slots[slot]->recordAt(record.pos);
+            slots[slot]->discardAt(record.pos);
+            slots[slotFor(record.place, normal)]->addNew(normal, animal.name, animal.days * 2);
+        }
+        catch (const out_of_range&) {
+            out() << "Animal not found" << '\n';
+        }
+    }
+
+    // ATTACK <CONTAINER> <TYPE> <POS1> <POS2>
+    // Makes the animal at POS1 attack the animal at POS2.
+    // Both animals must be in the same container.
+    void attack(const CommandRecord& record) {
+        if (record.place == Place::Freedom) {
+            out() << "Animals cannot attack in Freedom" << '\n';
+            return;
+        }
+        if (record.pos == record.pos2) return; // Prevent self-attack.
+        int slot = slotFor(record.place, record.kind);
+        if (slot == noSlot) return;
+        try {
+            // The defender always ends up with 11 days, which kills it.
+            AnimalRecord attacker = slots[slot]->recordAt(record.pos);
+            slots[slot]->recordAt(record.pos2);
+            Animal::announceAttack(attacker.kind);
+            slots[slot]->discardAt(record.pos2);
+            if (stats) ++stats->attackKills;
+        }
+        catch (const out_of_range&) {
+            out() << "Animal not found" << '\n';
+        }
+    }
+
+    // TALK <CONTAINER> <TYPE> <POS> or TALK Freedom <POS>
+    // Prints the information of the animal at the specified position.
+    void talk(const CommandRecord& record) {
+        int slot = slotFor(record.place, record.kind);
+        if (slot == noSlot) return;
+        try {
+            AnimalRecord animal = slots[slot]->recordAt(record.pos);
+            Animal::talk(animal.name, animal.days);
+        }
+        catch (const out_of_range&) {
+            out() << "Animal not found" << '\n';
+        }
+    }
+
+    // PERIOD [<K>]
+    // Adds K days (one if not given) to every animal; an animal whose age exceeds 10 dies.
+    // Deaths are reported as K single PERIODs would report them: day by day, and
+    // container by container within a day. Runs of days on which no container can
+    // lose an animal pass in one step, so the cost follows the deaths, not K.
+    void period(const CommandRecord& record) {
+        for (long long remaining = record.pos; remaining > 0;) {
+            long long quiet = remaining;
+            for (IContainer* container : slots)
+                quiet = min(quiet, container->quietDays());
+            if (quiet > 0) {
+                for (IContainer* container : slots)
+                    container->skipDays(quiet);
+                remaining -= quiet;
+                continue;
+            }
+            for (size_t slot = 0; slot < slotCount; slot++) {
+                uint64_t start = stats ? nowNanos() : 0;
+                periodUpdate(*slots[slot]);
+                if (stats)
+                    stats->containers[slot].record(nowNanos() - start);
+            }
+            --remaining;
+        }
+    }
+
+    // COUNT [<CONTAINER> [<TYPE>]]
+    // Prints the number of animals in the selected containers.
+    void count(const CommandRecord& record) {
+        size_t total = 0;
+        forSelected(record, [&](IContainer& container) { total += container.size(); });
+        out() << "Count: " << total << '\n';
+    }
+
+    // HISTOGRAM [<CONTAINER> [<TYPE>]]
+    // Prints the number of animals per days lived value in the selected containers,
+    // in O(d log d) for d distinct values.
+    void histogram(const CommandRecord& record) {
+        map<int, size_t> counts;
+        forSelected(record, [&](IContainer& container) { container.addHistogram(counts); });
+        for (auto& entry : counts)
+            out() << "Days lived " << entry.first << ": " << entry.second << '\n';
+    }
+
+    // TOPK <K> [<CONTAINER> [<TYPE>]]
+    // Prints the K oldest animals of the selected containers, oldest first;
+    // each container's order is followed from its end, so ties go by name, descending.
+    void topK(const CommandRecord& record) {
+        vector<pair<IContainer*, int>> heads; // Next position from the end, per container
+        forSelected(record, [&](IContainer& container) {
+            if (container.size() > 0)
+                heads.emplace_back(&container, int(container.size()) - 1);
+        });
+        vector<AnimalRecord> next;
+        for (auto& head : heads)
+            next.push_back(head.first->recordAt(head.second));
+        for (int k = 0; k < record.pos && !heads.empty(); k++) {
+            size_t best = 0;
+            for (size_t i = 1; i < heads.size(); i++)
+                if (next[i].days > next[best].days
+                    || (next[i].days == next[best].days && next[best].name < next[i].name))
+                    best = i;
+            out() << next[best].name.str() << ", days lived: " << next[best].days << '\n';
+            if (--heads[best].second >= 0) {
+                next[best] = heads[best].first->recordAt(heads[best].second);
+            } else {
+                heads.erase(heads.begin() + best);
+                next.erase(next.begin() + best);
+            }
+        }
+    }
+
+    // RANGE <LOW> <HIGH> [<CONTAINER> [<TYPE>]]
+    // Prints the number of animals with days lived from LOW to HIGH in the selected containers,
+    // in O(log n) per container.
+    void range(const CommandRecord& record) {
+        size_t total = 0;
+        forSelected(record, [&](IContainer& container) { total += container.countInRange(record.pos, record.pos2); });
+        out() << "Count: " << total << '\n';
+    }
+
+    // APPLY_SUBSTANCE_BY_NAME <NAME>, REMOVE_SUBSTANCE_BY_NAME <NAME>,
+    // ATTACK_BY_NAME <NAME1> <NAME2>, TALK_BY_NAME <NAME>
+    // The positional command, on the animal found by name: the first one in
+    // container order, in the first container (in PERIOD order) that has one.
+    // The defender must be in the attacker's container.
+    // Container and positions of a by-name command, or noSlot if an animal is missing.
+    int resolve(const CommandRecord& record, CommandRecord& resolved) const {
+        int slot = noSlot;
+        for (size_t s = 0; s < slotCount && slot == noSlot; s++)
+            if ((resolved.pos = slots[s]->positionOf(record.name)) >= 0)
+                slot = int(s);
+        if (slot != noSlot && record.command == Command::AttackByName)
+            resolved.pos2 = slots[slot]->positionOf(record.other);
+        if (slot == noSlot || resolved.pos2 < 0) return noSlot;
+        resolved.place = slotPlace[slot];
+        resolved.kind = slotKind[slot];
+        return slot;
+    }
+
+    // Container a command acts on, for statistics. Worked out before the command
+    // runs and without touching World members, so shards can dispatch concurrently.
+    int targetOf(const CommandRecord& record) const {
+        switch (record.command) {
+        case Command::ApplySubstance:
+        case Command::RemoveSubstance:
+            if (record.place == Place::Freedom) return noSlot;
+            [[fallthrough]];
+        case Command::Create:
+        case Command::Attack:
+        case Command::Talk:
+            return slotFor(record.place, record.kind);
+        case Command::ApplySubstanceByName:
+        case Command::RemoveSubstanceByName:
+        case Command::AttackByName:
+        case Command::TalkByName: {
+            CommandRecord resolved;
+            return resolve(record, resolved);
+        }
+        default:
+            return noSlot;
+        }
+    }
+
+    void byName(const CommandRecord& record) {
+        CommandRecord resolved;
+        if (resolve(record, resolved) == noSlot) {
+            out() << "Animal not found" << '\n';
+            return;
+        }
+        switch (record.command) {
+        case Command::ApplySubstanceByName: applySubstance(resolved); break;
+        case Command::RemoveSubstanceByName: removeSubstance(resolved); break;
+        case Command::AttackByName: attack(resolved); break;
+        default: talk(resolved); break;
+        }
+    }
+
+    template <typename Visit>
+    void forSelected(const CommandRecord& record, Visit visit) {
+        uint32_t selected = slotsSelected(record);
+        for (size_t slot = 0; slot < slotCount; slot++)
+            if (selected >> slot & 1)
+                visit(*slots[slot]);
+    }
+
+    void ignore(const CommandRecord&) {}
+
+    shared_ptr<NameTable> names = make_shared<NameTable>(); // Shared with forks
+    WorldContainers containers;
+    array<IContainer*, slotCount> slots;
+    uint64_t executed = 0;
+    string checkpointPath;
+    uint64_t checkpointEvery = 0;
+};
+
+// Command handlers, indexed by Command.
+const World::Handler World::handlers[] = {
+    &World::create, &World::applySubstance, &World::removeSubstance,
+    &World::attack, &World::talk, &World::period,
+    &World::count, &World::histogram, &World::topK, &World::range,
+    &World::byName, &World::byName, &World::byName, &World::byName, &World::ignore,
+};
+
+//-----------------------------------------------------
+// Command loop
+// Hands the command lines of an input to a callback. The first non-blank line holds
+// the number of commands (the rest of it is ignored); in streaming mode there is
+// no count and every line up to the end of input is a command.
+template <typename Callback>
+void forEachCommandLine(InputReader& input, bool streaming, Callback callback) {
+    string_view line;
+    long long C = LLONG_MAX;
+    if (!streaming) {
+        int count = 0;
+        while (input.nextLine(line)) {
+            if (line.find_first_not_of(" \t\r\v\f") == string_view::npos) continue;
+            LineTokens(line) >> count;
+            break;
+        }
+        C = count;
+    }
+
+    for (long long i = 0; i < C && input.nextLine(line); i++)
+        callback(line);
+}
+
+// Runs commands against a world in order, except that consecutive single
+// PERIODs are held back and run as one PERIOD of that many days when another
+// command or the end comes, unless commands are being timed one by one.
+class PeriodBatcher {
+public:
+    explicit PeriodBatcher(World& world) : world(world) { periods.command = Command::Period; }
+    PeriodBatcher(const PeriodBatcher&) = delete;
+    PeriodBatcher& operator=(const PeriodBatcher&) = delete;
+    ~PeriodBatcher() { flush(); }
+
+    void run(const CommandRecord& record) {
+        if (record.command == Command::Period && record.pos == 1 && !stats && periods.pos < INT_MAX) {
+            ++periods.pos;
+            return;
+        }
+        flush();
+        world.run(record);
+    }
+
+    // Run the PERIODs held back, if any.
+    void flush() {
+        if (periods.pos > 0) {
+            CommandRecord days = periods;
+            periods.pos = 0;
+            world.run(days, days.pos);
+        }
+    }
+
+private:
+    World& world;
+    CommandRecord periods; // The days held back
+};
+
+// Runs the commands of one input against a world. A world restored from a
+// snapshot skips the commands it has already run.
+void runCommands(World& world, InputReader& input, bool streaming) {
+    NameScope scope(world.nameTable());
+    PeriodBatcher batcher(world);
+    uint64_t skip = world.commandsRun();
+    forEachCommandLine(input, streaming, [&](string_view line) {
+        if (skip > 0)
+            --skip;
+        else
+            batcher.run(parseCommandLine(line));
+    });
+}
+
+//-----------------------------------------------------
+// Sharded executor
+// Runs the commands of a world on several threads, each owning some of the
+// containers. A container and its better counterpart share a shard, so only a
+// Monster conversion (which moves the animal into Freedom) can span two shards;
+// it runs on the lower one once the other has caught up with it and waits.
+// PERIOD goes to every shard, and each ages its own containers.
+// Commands are handled in windows: every shard walks the window in command order
+// and runs the commands that touch its containers (commands touching none run on
+// the first shard). Output is captured per shard in pieces tagged with the command,
+// and with the container for PERIOD, and the pieces are written back in command
+// order, so the output is the same as that of a sequential run.
+// The next window is parsed while the shards work on the current one.
+class ShardedExecutor {
+public:
+    ShardedExecutor(World& world, size_t shardCount) : world(world) {
+        // Group every container with its better counterpart, then deal the groups out.
+        array<size_t, slotCount> group;
+        for (size_t slot = 0; slot < slotCount; slot++)
+            group[slot] = slot;
+        for (Place place : {Place::Cage, Place::Aquarium})
+            for (size_t kind = 0; kind < kindCount; kind++) {
+                int normal = slotFor(place, AnimalKind(kind));
+                int better = slotFor(place, betterKind[kind]);
+                if (normal != noSlot && better != noSlot)
+                    group[better] = group[normal];
+            }
+        vector<size_t> groups(group.begin(), group.end());
+        sort(groups.begin(), groups.end());
+        groups.erase(unique(groups.begin(), groups.end()), groups.end());
+        shards = vector<Shard>(clamp<size_t>(shardCount, 1, groups.size()));
+        for (size_t slot = 0; slot < slotCount; slot++) {
+            size_t index = lower_bound(groups.begin(), groups.end(), group[slot]) - groups.begin();
+            shardOf[slot] = index % shards.size();
+            shards[shardOf[slot]].slots |= 1u << slot;
+        }
+        for (Window& window : windows) {
+            window.arrived.reset(new atomic<uint32_t>[windowSize]);
+            window.done.reset(new atomic<bool>[windowSize]);
+        }
+        for (size_t s = 0; s < shards.size(); s++)
+            shards[s].worker = thread([this, s] { work(s); });
+    }
+    ShardedExecutor(const ShardedExecutor&) = delete;
+    ShardedExecutor& operator=(const ShardedExecutor&) = delete;
+    ~ShardedExecutor() {
+        {
+            lock_guard<mutex> lock(guard);
+            stopping = true;
+        }
+        started.notify_all();
+        for (Shard& shard : shards)
+            shard.worker.join();
+    }
+
+    // Run the commands of an input, skipping those a restored world has already run.
+    // A command that throws is rethrown here, after the output before it is written.
+    void run(InputReader& input, bool streaming) {
+        NameScope scope(world.nameTable());
+        uint64_t skip = world.commandsRun();
+        forEachCommandLine(input, streaming, [&](string_view line) {
+            if (skip > 0) {
+                --skip;
+                return;
+            }
+            Window& window = windows[filling];
+            window.records.push_back(parseCommandLine(line));
+            if (window.records.size() == windowSize)
+                submit();
+        });
+        if (!windows[filling].records.empty())
+            submit();
+        if (running >= 0)
+            complete(exchange(running, -1));
+    }
+
+private:
+    static constexpr size_t windowSize = 4096;
+    static constexpr size_t noFailure = SIZE_MAX;
+
+    struct Window {
+        vector<CommandRecord> records;
+        vector<uint32_t> shardSets;             // Shards each command runs on, as bits
+        unique_ptr<atomic<uint32_t>[]> arrived; // Shards waiting at a command spanning shards
+        unique_ptr<atomic<bool>[]> done;        // Whether such a command has been run
+        atomic<size_t> failedAt{noFailure};     // First command that threw
+        exception_ptr failure;
+        mutex failureGuard;
+    };
+
+    // Output of one command (or of one container, for PERIOD) in a shard's text.
+    struct Piece {
+        size_t command, slot;
+        size_t begin, end;
+    };
+
+    struct Shard {
+        uint32_t slots = 0; // Containers owned, as bits
+        thread worker;
+        string text[2];     // Output, per window buffer
+        vector<Piece> pieces[2];
+    };
+
+    // Containers a command may touch, as bits.
+    static uint32_t slotsTouched(const CommandRecord& record) {
+        auto bit = [](int slot) { return slot == noSlot ? 0u : 1u << slot; };
+        int slot = slotFor(record.place, record.kind);
+        AnimalKind kind = record.kind;
+        switch (record.command) {
+        case Command::Create:
+        case Command::Attack:
+        case Command::Talk:
+            return bit(slot);
+        case Command::ApplySubstance:
+            if (slot == noSlot || record.place == Place::Freedom) return 0;
+            if (betterKind[size_t(kind)] != AnimalKind::Unknown)
+                return bit(slot) | bit(slotFor(record.place, betterKind[size_t(kind)]));
+            return bit(slot) | bit(freedomSlot);
+        case Command::RemoveSubstance:
+            if (slot == noSlot || record.place == Place::Freedom) return 0;
+            return bit(slot) | bit(slotFor(record.place, normalKind[size_t(kind)]));
+        case Command::Period:
+        case Command::ApplySubstanceByName:
+        case Command::RemoveSubstanceByName:
+        case Command::AttackByName:
+        case Command::TalkByName:
+            return allSlots; // by name: any container, known only when it runs
+        case Command::Count:
+        case Command::Histogram:
+        case Command::TopK:
+        case Command::Range:
+            return slotsSelected(record);
+        default:
+            return 0;
+        }
+    }
+
+    static bool isSingleDay(const CommandRecord& record) {
+        return record.command == Command::Period && record.pos == 1;
+    }
+
+    uint32_t shardsOf(uint32_t slots) const {
+        uint32_t set = 0;
+        for (size_t slot = 0; slot < slotCount; slot++)
+            if (slots >> slot & 1)
+                set |= 1u << shardOf[slot];
+        return set ? set : 1u;
+    }
+
+    // Hand the filled window to the shards, once the previous one is written out.
+    void submit() {
+        if (running >= 0)
+            complete(running);
+        Window& window = windows[filling];
+        window.shardSets.resize(window.records.size());
+        for (size_t i = 0; i < window.records.size(); i++) {
+            window.shardSets[i] = shardsOf(slotsTouched(window.records[i]));
+            window.arrived[i].store(0, memory_order_relaxed);
+            window.done[i].store(false, memory_order_relaxed);
+        }
+        window.failedAt.store(noFailure, memory_order_relaxed);
+        window.failure = nullptr;
+        {
+            lock_guard<mutex> lock(guard);
+            current = filling;
+            ++generation;
+            busy = shards.size();
+        }
+        started.notify_all();
+        running = filling;
+        filling ^= 1;
+        windows[filling].records.clear();
+    }
+
+    // Wait for the shards to finish a window and write its output in command order.
+    void complete(int buffer) {
+        {
+            unique_lock<mutex> lock(guard);
+            finished.wait(lock, [this] { return busy == 0; });
+        }
+        Window& window = windows[buffer];
+        size_t failedAt = window.failedAt.load();
+        vector<size_t> next(shards.size(), 0);
+        vector<pair<const Piece*, const string*>> parts;
+        for (size_t i = 0; i < window.records.size() && i <= failedAt; i++) {
+            parts.clear();
+            for (size_t s = 0; s < shards.size(); s++) {
+                const vector<Piece>& pieces = shards[s].pieces[buffer];
+                for (; next[s] < pieces.size() && pieces[next[s]].command == i; next[s]++)
+                    parts.emplace_back(&pieces[next[s]], &shards[s].text[buffer]);
+            }
+            sort(parts.begin(), parts.end(), [](auto& a, auto& b) { return a.first->slot < b.first->slot; });
+            for (auto& part : parts)
+                out() << string_view(*part.second).substr(part.first->begin, part.first->end - part.first->begin);
+        }
+        if (window.failure)
+            rethrow_exception(window.failure);
+        world.countRun(window.records.size());
+    }
+
+    void work(size_t s) {
+        uint64_t seen = 0;
+        while (true) {
+            int buffer;
+            {
+                unique_lock<mutex> lock(guard);
+                started.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                buffer = current;
+            }
+            runWindow(s, buffer);
+            {
+                lock_guard<mutex> lock(guard);
+                --busy;
+            }
+            finished.notify_one();
+        }
+    }
+
+    // Run the commands of a window that belong to shard s.
+    void runWindow(size_t s, int buffer) {
+        Window& window = windows[buffer];
+        Shard& shard = shards[s];
+        string& text = shard.text[buffer];
+        vector<Piece>& pieces = shard.pieces[buffer];
+        text.clear();
+        pieces.clear();
+        OutputWriter writer(text);
+        OutputRedirect redirect(writer);
+        // Close off the output since the last piece as the piece of command i.
+        auto capture = [&](size_t i, size_t slot) {
+            size_t begin = text.size();
+            writer.flush();
+            if (text.size() > begin)
+                pieces.push_back({i, slot, begin, text.size()});
+        };
+        uint32_t self = 1u << s;
+        for (size_t i = 0; i < window.records.size(); i++) {
+            if (i >= window.failedAt.load(memory_order_acquire)) break;
+            uint32_t set = window.shardSets[i];
+            if (!(set & self)) continue;
+            const CommandRecord& record = window.records[i];
+            // Single days are aged by each shard on its own, a run of them at a
+            // time: a container ages apart from the others, so it passes over the
+            // days on which it cannot lose an animal in one step, and its deaths on
+            // the other days are put with the PERIOD of that day. A PERIOD of several
+            // days interleaves the containers' deaths day by day, so it runs below
+            // like any command spanning every shard.
+            if (isSingleDay(record)) {
+                size_t end = i + 1;
+                while (end < window.records.size() && isSingleDay(window.records[end]))
+                    ++end;
+                size_t first = pieces.size();
+                for (size_t slot = 0; slot < slotCount; slot++) {
+                    if (!(shard.slots >> slot & 1)) continue;
+                    IContainer& container = world.container(slot);
+                    for (size_t day = i; day < end;) {
+                        long long quiet = min<long long>(container.quietDays(), end - day);
+                        if (quiet > 0) {
+                            container.skipDays(quiet);
+                            day += quiet;
+                            continue;
+                        }
+                        periodUpdate(container);
+                        capture(day++, slot);
+                    }
+                }
+                // Pieces were made container by container; they go out day by day.
+                stable_sort(pieces.begin() + first, pieces.end(),
+                            [](const Piece& a, const Piece& b) { return a.command < b.command; });
+                i = end - 1;
+                continue;
+            }
+            if (set != self) {
+                // Spanning shards: the lowest one runs it while the others wait.
+                auto abandoned = [&] { return i >= window.failedAt.load(memory_order_acquire); };
+                if ((set & -set) != self) {
+                    window.arrived[i].fetch_add(1, memory_order_acq_rel);
+                    while (!window.done[i].load(memory_order_acquire) && !abandoned())
+                        this_thread::yield();
+                    continue;
+                }
+                uint32_t others = uint32_t(bitset<32>(set).count()) - 1;
+                while (window.arrived[i].load(memory_order_acquire) < others && !abandoned())
+                    this_thread::yield();
+            }
+            try {
+                world.dispatch(record);
+            }
+            catch (...) {
+                capture(i, 0);
+                lock_guard<mutex> lock(window.failureGuard);
+                if (i < window.failedAt.load()) {
+                    window.failure = current_exception();
+                    window.failedAt.store(i, memory_order_release);
+                }
+                break;
+            }
+            capture(i, 0);
+            if (set != self)
+                window.done[i].store(true, memory_order_release);
+        }
+    }
+
+    World& world;
+    vector<Shard> shards;
+    array<size_t, slotCount> shardOf{};
+    Window windows[2];
+    int filling = 0;  // Window being parsed into
+    int running = -1; // Window the shards are working on, if any
+
+    mutex guard;
+    condition_variable started, finished;
+    uint64_t generation = 0;
+    int current = 0;
+    size_t busy = 0;
+    bool stopping = false;
+};
+
+//-----------------------------------------------------
+// Single-producer, single-consumer ring
+// A bounded queue between two threads, without locks: the producer only moves
+// the tail and the consumer only moves the head, and each keeps a cached copy
+// of the other's index so that it reads the shared one only when the ring
+// looks full (or empty). A full ring makes the producer wait, which bounds how
+// far it can run ahead.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Producer side.
+    void push(T item) {
+        size_t tail = producer.index;
+        while (tail - producer.cached > mask) {
+            producer.cached = head.load(memory_order_acquire);
+            if (tail - producer.cached > mask)
+                this_thread::yield();
+        }
+        slots[tail & mask] = move(item);
+        producer.index = tail + 1;
+        this->tail.store(tail + 1, memory_order_release);
+    }
+    void close() { closed.store(true, memory_order_release); }
+
+    // Consumer side: false once the ring is closed and drained.
+    bool pop(T& item) {
+        size_t head = consumer.index;
+        while (head == consumer.cached) {
+            bool wasClosed = closed.load(memory_order_acquire);
+            consumer.cached = tail.load(memory_order_acquire);
+            if (head != consumer.cached) break;
+            if (wasClosed) return false;
+            this_thread::yield();
+        }
+        item = move(slots[head & mask]);
+        consumer.index = head + 1;
+        this->head.store(head + 1, memory_order_release);
+        return true;
+    }
+
+private:
+    struct alignas(64) Side {
+        size_t index = 0;  // Own index
+        size_t cached = 0; // Last seen index of the other side
+    };
+
+    vector<T> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head{0}; // Next slot to pop
+    alignas(64) atomic<size_t> tail{0}; // Next slot to push
+    atomic<bool> closed{false};
+    Side producer, consumer;
+};
+
+//-----------------------------------------------------
+// Pipelined execution
+// Reading and parsing run on their own thread, which hands decoded commands to
+// the executing thread through an SPSC ring; with --async-output the output is
+// written by a third thread. The commands run in the same order on one world,
+// so the output is the same as in a plain run.
+void runPipelined(World& world, InputReader& input, bool streaming) {
+    SpscRing<CommandRecord> ring(4096);
+    uint64_t skip = world.commandsRun();
+    thread parser([&] {
+        NameScope scope(world.nameTable());
+        forEachCommandLine(input, streaming, [&](string_view line) {
+            if (skip > 0)
+                --skip;
+            else
+                ring.push(parseCommandLine(line));
+        });
+        ring.close();
+    });
+    PeriodBatcher batcher(world);
+    CommandRecord record;
+    while (ring.pop(record))
+        batcher.run(record);
+    batcher.flush();
+    parser.join();
+}
+
+//-----------------------------------------------------
+// Binary command format
+// A command stream compiled ahead of time, so that a replay skips tokenizing:
+//   "A2CB", version byte
+//   varint name count, then per name: varint length, bytes
+//   varint command count, then per command a varint opcode
+//     (command | place << 4 | kind << 6 | unmatched << 9) followed by its operands:
+//     CREATE: varint name index, zigzag days
+//     APPLY_SUBSTANCE, REMOVE_SUBSTANCE, TALK, TOPK: zigzag pos
+//     PERIOD: zigzag days
+//     ATTACK, RANGE: zigzag pos, zigzag pos2
+//     APPLY_SUBSTANCE_BY_NAME, REMOVE_SUBSTANCE_BY_NAME, TALK_BY_NAME: varint name index
+//     ATTACK_BY_NAME: varint name index, varint name index
+// Varints are LEB128; signed values are zigzag-encoded as 32-bit first, so
+// -1 is 1 and INT_MIN takes five bytes.
+constexpr char binaryMagic[4] = {'A', '2', 'C', 'B'};
+constexpr uint8_t binaryVersion = 5;
+
+void putVarint(string& bytes, uint64_t value) {
+    while (value >= 0x80) {
+        bytes += char(value | 0x80);
+        value >>= 7;
+    }
+    bytes += char(value);
+}
+
+void putSigned(string& bytes, int value) {
+    putVarint(bytes, (uint32_t(value) << 1) ^ uint32_t(value >> 31));
+}
+
+// Reader over a compiled stream; any read past the end marks it as truncated.
+class BinaryReader {
+public:
+    BinaryReader(const char* data, size_t size) : cur((const uint8_t*)data), end(cur + size) {}
+
+    bool ok() const { return !truncated; }
+    bool atEnd() const { return cur == end; }
+
+    uint8_t byte() {
+        if (cur == end) {
+            truncated = true;
+            return 0;
+        }
+        return *cur++;
+    }
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t b = byte();
+            value |= uint64_t(b & 0x7F) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return value;
+    }
+    int signedInt() {
+        uint32_t value = uint32_t(varint());
+        return int(value >> 1) ^ -int(value & 1);
+    }
+    string_view bytes(size_t size) {
+        if (size > size_t(end - cur)) {
+            truncated = true;
+            cur = end;
+            return {};
+        }
+        string_view view((const char*)cur, size);
+        cur += size;
+        return view;
+    }
+
+private:
+    const uint8_t* cur;
+    const uint8_t* end;
+    bool truncated = false;
+};
+
+// Compile the text commands of an input into the binary format.
+string compileCommands(InputReader& input, bool streaming) {
+    string names, commands;
+    unordered_map<uint32_t, uint64_t> nameIndex; // Name id -> index in the name table
+    uint64_t commandCount = 0;
+    // A name goes into the name table once; commands refer to it by index.
+    auto putName = [&](const Name& name) {
+        auto entry = nameIndex.emplace(name.getId(), nameIndex.size());
+        if (entry.second) {
+            string_view text = name.str();
+            putVarint(names, text.size());
+            names += text;
+        }
+        putVarint(commands, entry.first->second);
+    };
+    forEachCommandLine(input, streaming, [&](string_view line) {
+        CommandRecord record = parseCommandLine(line);
+        ++commandCount;
+        putVarint(commands, unsigned(record.command) | unsigned(record.place) << 4 | unsigned(record.kind) << 6
+                                | unsigned(record.unmatched) << 9);
+        switch (record.command) {
+        case Command::Create:
+            putName(record.name);
+            putSigned(commands, record.days);
+            break;
+        case Command::AttackByName:
+            putName(record.name);
+            putName(record.other);
+            break;
+        case Command::ApplySubstanceByName:
+        case Command::RemoveSubstanceByName:
+        case Command::TalkByName:
+            putName(record.name);
+            break;
+        case Command::Attack:
+        case Command::Range:
+            putSigned(commands, record.pos);
+            putSigned(commands, record.pos2);
+            break;
+        case Command::ApplySubstance:
+        case Command::RemoveSubstance:
+        case Command::Talk:
+        case Command::TopK:
+        case Command::Period:
+            putSigned(commands, record.pos);
+            break;
+        default:
+            break;
+        }
+    });
+
+    string file(binaryMagic, sizeof binaryMagic);
+    file += char(binaryVersion);
+    putVarint(file, nameIndex.size());
+    file += names;
+    putVarint(file, commandCount);
+    file += commands;
+    return file;
+}
+
+// Execute a compiled stream against a world; false if it is not a valid stream.
+bool replayCommands(World& world, const char* data, size_t size) {
+    NameScope scope(world.nameTable());
+    BinaryReader in(data, size);
+    if (in.bytes(sizeof binaryMagic) != string_view(binaryMagic, sizeof binaryMagic)
+        || in.byte() != binaryVersion)
+        return false;
+
+    uint64_t nameCount = in.varint();
+    if (nameCount > size) return false;
+    vector<Name> names(nameCount);
+    NameTable::current().reserve(names.size());
+    for (Name& name : names) {
+        string_view text = in.bytes(in.varint());
+        if (!in.ok()) return false;
+        name = Name(text);
+    }
+
+    auto getName = [&](Name& name) {
+        uint64_t index = in.varint();
+        if (index >= names.size()) return false;
+        name = names[index];
+        return true;
+    };
+    uint64_t commandCount = in.varint();
+    uint64_t skip = world.commandsRun();
+    PeriodBatcher batcher(world); // Runs what was held back on any way out
+    for (uint64_t i = 0; i < commandCount && in.ok(); i++) {
+        uint64_t opcode = in.varint();
+        CommandRecord record;
+        record.command = Command(min<uint64_t>(opcode & 15, uint64_t(Command::Unknown)));
+        record.place = Place(opcode >> 4 & 3);
+        record.kind = AnimalKind(opcode >> 6 & 7);
+        record.unmatched = opcode >> 9 & 1;
+        switch (record.command) {
+        case Command::Create:
+            if (!getName(record.name)) return false;
+            record.days = in.signedInt();
+            break;
+        case Command::AttackByName:
+            if (!getName(record.name) || !getName(record.other)) return false;
+            break;
+        case Command::ApplySubstanceByName:
+        case Command::RemoveSubstanceByName:
+        case Command::TalkByName:
+            if (!getName(record.name)) return false;
+            break;
+        case Command::Attack:
+        case Command::Range:
+            record.pos = in.signedInt();
+            record.pos2 = in.signedInt();
+            break;
+        case Command::ApplySubstance:
+        case Command::RemoveSubstance:
+        case Command::Talk:
+        case Command::TopK:
+        case Command::Period:
+            record.pos = in.signedInt();
+            break;
+        default:
+            break;
+        }
+        if (!in.ok()) return false;
+        if (i >= skip)
+            batcher.run(record);
+    }
+    return in.ok();
+}
+
+//-----------------------------------------------------
+// Memory-mapped file
+// Read-only view of a whole file; falls back to reading it when it cannot be mapped.
+class MappedFile {
+public:
+    explicit MappedFile(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                mapping = static_cast<const char*>(mapped);
+                length = st.st_size;
+                valid = true;
+                close(fd);
+                return;
+            }
+        }
+        char chunk[1 << 16];
+        ssize_t got;
+        while ((got = read(fd, chunk, sizeof chunk)) > 0)
+            copy.append(chunk, got);
+        valid = got == 0;
+        close(fd);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        if (mapping)
+            munmap(const_cast<char*>(mapping), length);
+    }
+
+    bool isOpen() const { return valid; }
+    const char* data() const { return mapping ? mapping : copy.data(); }
+    size_t size() const { return mapping ? length : copy.size(); }
+
+private:
+    const char* mapping = nullptr;
+    size_t length = 0;
+    string copy;
+    bool valid = false;
+};
+
+//-----------------------------------------------------
+// World snapshots
+// A checkpoint of a world as a flat file that is used in place once mapped:
+//   SnapshotHeader
+//   end offset of every name (uint64), then the name bytes, padded to 8
+//   one SnapshotRow per animal, container by container, each in sorted order
+// Everything is located by offsets, so the file does not depend on where it is
+// mapped. Restoring interns the names and links every container's rows in the
+// stored order; nothing is replayed or sorted again.
+constexpr char snapshotMagic[4] = {'A', '2', 'S', 'N'};
+constexpr uint32_t snapshotVersion = 1;
+
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t commandOffset;       // Commands the world had run when it was saved
+    uint64_t rowCount[slotCount]; // Animals per container
+    uint64_t nameCount;
+    uint64_t nameBytes;
+};
+
+struct SnapshotRow {
+    int32_t days;
+    uint32_t name; // Index of the name in the snapshot
+    uint32_t kind;
+};
+
+constexpr uint64_t alignTo8(uint64_t size) { return (size + 7) & ~uint64_t(7); }
+
+bool saveSnapshot(World& world, const string& path) {
+    SnapshotHeader header{};
+    memcpy(header.magic, snapshotMagic, sizeof snapshotMagic);
+    header.version = snapshotVersion;
+    header.commandOffset = world.commandsRun();
+
+    vector<uint64_t> nameEnds;
+    string nameText;
+    vector<SnapshotRow> rows;
+    unordered_map<uint32_t, uint32_t> nameIndex; // Name id -> index in the snapshot
+    for (size_t slot = 0; slot < slotCount; slot++) {
+        vector<AnimalRecord> contents = world.container(slot).sortedContents();
+        header.rowCount[slot] = contents.size();
+        for (const AnimalRecord& animal : contents) {
+            auto entry = nameIndex.emplace(animal.name.getId(), uint32_t(nameIndex.size()));
+            if (entry.second) {
+                nameText += animal.name.str();
+                nameEnds.push_back(nameText.size());
+            }
+            rows.push_back({animal.days, entry.first->second, uint32_t(animal.kind)});
+        }
+    }
+    header.nameCount = nameEnds.size();
+    header.nameBytes = nameText.size();
+    nameText.resize(alignTo8(nameText.size()));
+
+    // Write next to the target and rename, so a crash never leaves half a snapshot.
+    string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    {
+        OutputWriter file(fd);
+        file << string_view((const char*)&header, sizeof header)
+             << string_view((const char*)nameEnds.data(), nameEnds.size() * sizeof(uint64_t))
+             << nameText
+             << string_view((const char*)rows.data(), rows.size() * sizeof(SnapshotRow));
+    }
+    bool written = fsync(fd) == 0;
+    close(fd);
+    return written && rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+// Load a snapshot into a fresh world; false if it is not a valid snapshot.
+bool restoreSnapshot(World& world, const char* data, size_t size) {
+    NameScope scope(world.nameTable());
+    SnapshotHeader header;
+    if (size < sizeof header) return false;
+    memcpy(&header, data, sizeof header);
+    if (memcmp(header.magic, snapshotMagic, sizeof snapshotMagic) != 0 || header.version != snapshotVersion)
+        return false;
+    uint64_t rowTotal = 0;
+    for (uint64_t rows : header.rowCount) {
+        if (rows > size / sizeof(SnapshotRow)) return false;
+        rowTotal += rows;
+    }
+    if (header.nameCount > size / sizeof(uint64_t) || header.nameBytes > size) return false;
+    uint64_t textAt = sizeof header + header.nameCount * sizeof(uint64_t);
+    uint64_t rowsAt = textAt + alignTo8(header.nameBytes);
+    if (rowTotal > size / sizeof(SnapshotRow) || rowsAt + rowTotal * sizeof(SnapshotRow) > size)
+        return false;
+
+    const uint64_t* nameEnds = reinterpret_cast<const uint64_t*>(data + sizeof header);
+    vector<Name> names(header.nameCount);
+    NameTable::current().reserve(names.size());
+    uint64_t begin = 0;
+    for (uint64_t i = 0; i < header.nameCount; i++) {
+        uint64_t end = nameEnds[i];
+        if (end < begin || end > header.nameBytes) return false;
+        names[i] = Name(string_view(data + textAt + begin, end - begin));
+        begin = end;
+    }
+
+    const SnapshotRow* row = reinterpret_cast<const SnapshotRow*>(data + rowsAt);
+    for (size_t slot = 0; slot < slotCount; slot++) {
+        vector<AnimalRecord> contents;
+        contents.reserve(header.rowCount[slot]);
+        for (uint64_t i = 0; i < header.rowCount[slot]; i++, row++) {
+            if (row->name >= names.size() || row->kind >= uint32_t(AnimalKind::Unknown)) return false;
+            contents.push_back({AnimalKind(row->kind), names[row->name], row->days});
+        }
+        if (!world.container(slot).restoreSorted(contents)) return false;
+    }
+    world.resumeAt(header.commandOffset);
+    return true;
+}
+
+bool World::checkpoint() {
+    out().flush();
+    if (saveSnapshot(*this, checkpointPath)) return true;
+    fprintf(stderr, "%s: %s\n", checkpointPath.c_str(), strerror(errno));
+    return false;
+}
+
+//-----------------------------------------------------
+// Work-stealing thread pool
+// Tasks are dealt round-robin into one deque per worker. A worker takes tasks
+// from the back of its own deque and, once that is empty, steals from the front
+// of the others, so uneven tasks still keep every core busy.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t threads) : queues(max<size_t>(threads, 1)) {}
+
+    void submit(function<void()> task) {
+        Queue& queue = queues[next++ % queues.size()];
+        lock_guard<mutex> lock(queue.guard);
+        queue.tasks.push_back(move(task));
+    }
+
+    // Run every submitted task and return once all of them are done.
+    void run() {
+        vector<thread> workers;
+        for (size_t i = 1; i < queues.size(); i++)
+            workers.emplace_back([this, i] { work(i); });
+        work(0);
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+private:
+    struct Queue {
+        mutex guard;
+        deque<function<void()>> tasks;
+    };
+
+    void work(size_t self) {
+        function<void()> task;
+        while (take(self, task) || steal(self, task))
+            task();
+    }
+
+    bool take(size_t self, function<void()>& task) {
+        Queue& queue = queues[self];
+        lock_guard<mutex> lock(queue.guard);
+        if (queue.tasks.empty()) return false;
+        task = move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t self, function<void()>& task) {
+        for (size_t i = 1; i < queues.size(); i++) {
+            Queue& victim = queues[(self + i) % queues.size()];
+            lock_guard<mutex> lock(victim.guard);
+            if (victim.tasks.empty()) continue;
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    vector<Queue> queues;
+    size_t next = 0;
+};
+
+//-----------------------------------------------------
+// Batch mode
+// Runs many independent inputs in parallel, each against its own world, and
+// writes the output of <file> to <file>.out (or into the given directory).
+// Returns the number of inputs that could not be run to the end.
+// With statistics enabled, the statistics of every world are merged into totals.
+int runBatch(const vector<string>& files, const string& outDir, size_t jobs, bool streaming,
+             Stats* totals = nullptr, World* prefix = nullptr) {
+    atomic<int> failures{0};
+    mutex totalsGuard;
+    WorkStealingPool pool(min(jobs, files.size()));
+    for (const string& file : files) {
+        // Forks are taken here, on the thread that owns the prefix world.
+        shared_ptr<World> start = prefix ? shared_ptr<World>(prefix->fork()) : nullptr;
+        pool.submit([&, file, start]() mutable {
+            string target = file + ".out";
+            if (!outDir.empty())
+                target = outDir + "/" + target.substr(target.find_last_of('/') + 1);
+            int inFd = open(file.c_str(), O_RDONLY);
+            int outFd = inFd < 0 ? -1 : open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (inFd < 0 || outFd < 0) {
+                fprintf(stderr, "%s: %s\n", inFd < 0 ? file.c_str() : target.c_str(), strerror(errno));
+                if (inFd >= 0) close(inFd);
+                ++failures;
+                return;
+            }
+            {
+                OutputWriter writer(outFd);
+                OutputRedirect redirect(writer);
+                unique_ptr<Stats> local;
+                if (totals) {
+                    local = make_unique<Stats>(commandCount, slotCount);
+                    stats = local.get();
+                }
+                try {
+                    InputReader input(inFd);
+                    shared_ptr<World> world = start ? move(start) : make_shared<World>();
+                    runCommands(*world, input, streaming);
+                }
+                catch (const exception& e) {
+                    fprintf(stderr, "%s: stopped by an invalid command%s%s\n", file.c_str(),
+                            *e.what() ? ": " : "", e.what());
+                    ++failures;
+                }
+                if (totals) {
+                    stats = nullptr;
+                    lock_guard<mutex> lock(totalsGuard);
+                    totals->merge(*local);
+                }
+            }
+            close(inFd);
+            close(outFd);
+        });
+    }
+    pool.run();
+    return failures;
+}
+
+//-----------------------------------------------------
+// Server mode
+// Listens on a Unix domain socket and gives every connection its own world.
+// One epoll loop reads whatever has arrived, runs every complete line as a
+// command and sends the output back as soon as the socket takes it, so a client
+// can pipeline commands without waiting for answers. Connections use the
+// streaming grammar: there is no count line (one sent anyway is an unknown
+// command and does nothing). Once a client shuts down its side, its last
+// unterminated line is run and the connection is closed when the output is out.
+// A command that would stop the program closes only its own connection.
+class Server {
+public:
+    explicit Server(const string& path) : path(path) {
+        sockaddr_un address{};
+        if (path.size() >= sizeof address.sun_path) {
+            errno = ENAMETOOLONG;
+            return;
+        }
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        // Take over the socket left behind by an earlier server, but no other file.
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(path.c_str());
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener < 0) return;
+        if (bind(listener, (const sockaddr*)&address, sizeof address) < 0 || listen(listener, SOMAXCONN) < 0) {
+            close(exchange(listener, -1));
+            return;
+        }
+        bound = true;
+        poller = epoll_create1(EPOLL_CLOEXEC);
+        if (poller >= 0)
+            watch(listener, EPOLLIN, EPOLL_CTL_ADD);
+    }
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+    ~Server() {
+        for (auto& session : sessions)
+            close(session.first);
+        if (poller >= 0) close(poller);
+        if (listener >= 0) close(listener);
+        if (bound) unlink(path.c_str());
+    }
+
+    bool isOpen() const { return listener >= 0 && poller >= 0; }
+
+    // Serve connections until stopped is set (by a signal handler).
+    void run(const volatile sig_atomic_t& stopped) {
+        epoll_event events[64];
+        while (!stopped) {
+            int ready = epoll_wait(poller, events, 64, -1);
+            for (int i = 0; i < ready; i++) {
+                int fd = events[i].data.fd;
+                if (fd == listener) {
+                    accept();
+                    continue;
+                }
+                auto found = sessions.find(fd);
+                if (found == sessions.end()) continue;
+                Session& session = *found->second;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    receive(fd, session);
+                else if (events[i].events & EPOLLOUT)
+                    send(fd, session);
+            }
+        }
+    }
+
+private:
+    static constexpr size_t maxPendingOutput = 1 << 20;
+
+    struct Session {
+        World world;
+        string input;        // Received bytes not run yet
+        string output;       // Output not sent yet, from sent on
+        size_t sent = 0;
+        bool closing = false; // No more commands: the client shut down, or a command failed
+    };
+
+    void watch(int fd, uint32_t events, int operation) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        epoll_ctl(poller, operation, fd, &event);
+    }
+
+    void accept() {
+        int fd;
+        while ((fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            sessions.emplace(fd, make_unique<Session>());
+            watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+        }
+    }
+
+    void drop(int fd) {
+        epoll_ctl(poller, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        sessions.erase(fd);
+    }
+
+    void receive(int fd, Session& session) {
+        char chunk[1 << 16];
+        while (!session.closing) {
+            ssize_t got = read(fd, chunk, sizeof chunk);
+            if (got > 0) {
+                session.input.append(chunk, got);
+            } else if (got == 0) {
+                session.closing = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else {
+                drop(fd);
+                return;
+            }
+        }
+        execute(session);
+        send(fd, session);
+    }
+
+    // Run the complete lines received so far, and the rest too once the input is over.
+    void execute(Session& session) {
+        OutputWriter writer(session.output);
+        OutputRedirect redirect(writer);
+        NameScope scope(session.world.nameTable());
+        string_view input = session.input;
+        size_t start = 0;
+        try {
+            PeriodBatcher batcher(session.world);
+            for (size_t newline; (newline = input.find('\n', start)) != string_view::npos; start = newline + 1)
+                batcher.run(parseCommandLine(input.substr(start, newline - start)));
+            if (session.closing && start < input.size()) {
+                batcher.run(parseCommandLine(input.substr(start)));
+                start = input.size();
+            }
+        }
+        catch (const exception& e) {
+            fprintf(stderr, "%s: connection stopped by an invalid command%s%s\n", path.c_str(),
+                    *e.what() ? ": " : "", e.what());
+            session.closing = true;
+            start = input.size();
+        }
+        session.input.erase(0, start);
+    }
+
+    // Send what the socket takes. A client that does not keep up with its output
+    // is not read from until it does; a closing session ends once all is sent.
+    void send(int fd, Session& session) {
+        while (session.sent < session.output.size()) {
+            ssize_t written = ::send(fd, session.output.data() + session.sent,
+                                     session.output.size() - session.sent, MSG_NOSIGNAL);
+            if (written > 0) {
+                session.sent += written;
+            } else if (written < 0 && errno == EINTR) {
+                continue;
+            } else if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                drop(fd);
+                return;
+            }
+        }
+        if (session.sent == session.output.size()) {
+            session.output.clear();
+            session.sent = 0;
+            if (session.closing) {
+                drop(fd);
+                return;
+            }
+        }
+        size_t pending = session.output.size() - session.sent;
+        uint32_t events = pending == 0 ? EPOLLIN : pending > maxPendingOutput || session.closing ? EPOLLOUT : EPOLLIN | EPOLLOUT;
+        watch(fd, events, EPOLL_CTL_MOD);
+    }
+
+    string path;
+    int listener = -1;
+    int poller = -1;
+    bool bound = false;
+    unordered_map<int, unique_ptr<Session>> sessions;
+};
+
+// Client for a server: sends standard input and copies the answers to standard
+// output while it is still sending, then waits for the rest.
+int runClient(const string& path) {
+    signal(SIGPIPE, SIG_IGN); // A server that goes away is a failed write, not a signal
+    sockaddr_un address{};
+    if (path.size() >= sizeof address.sun_path) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(ENAMETOOLONG));
+        return 1;
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (const sockaddr*)&address, sizeof address) < 0) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    auto copy = [](int from, int to) {
+        char chunk[1 << 16];
+        ssize_t got;
+        while ((got = read(from, chunk, sizeof chunk)) > 0 || (got < 0 && errno == EINTR)) {
+            for (ssize_t done = 0, written; done < got; done += written) {
+                written = write(to, chunk + done, got - done);
+                if (written < 0 && errno != EINTR) return;
+                written = max<ssize_t>(written, 0);
+            }
+        }
+    };
+    thread sender([&] {
+        copy(STDIN_FILENO, fd);
+        shutdown(fd, SHUT_WR);
+    });
+    copy(fd, STDOUT_FILENO);
+    sender.join();
+    close(fd);
+    return 0;
+}
+
+//-----------------------------------------------------
+// Workload generator
+// Produces seeded, reproducible command streams for benchmarking. Positions are
+// drawn against an estimate of each container's population, so most commands
+// hit an animal and some miss on purpose.
+enum class Scenario : uint8_t { Create, Period, Attack, Substance, Mixed, Ages, Unknown };
+
+constexpr const char* scenarioNames[] = {"create", "period", "attack", "substance", "mixed", "ages"};
+constexpr size_t scenarioCount = size_t(Scenario::Unknown);
+
+Scenario parseScenario(string_view token) {
+    for (size_t i = 0; i < scenarioCount; i++)
+        if (token == scenarioNames[i]) return Scenario(i);
+    return Scenario::Unknown;
+}
+
+class WorkloadGenerator {
+public:
+    WorkloadGenerator(Scenario scenario, uint64_t seed) : scenario(scenario), state(seed) {}
+
+    // Append one command line, without the newline, and return its command.
+    Command next(string& line) {
+        uint64_t roll = below(100);
+        switch (scenario) {
+        case Scenario::Create:
+            return roll < 90 ? create(line) : talk(line);
+        case Scenario::Period:
+            return roll < 50 ? create(line) : roll < 60 ? talk(line) : period(line);
+        case Scenario::Attack:
+            return roll < 40 ? create(line) : roll < 90 ? attack(line) : period(line);
+        case Scenario::Substance:
+            return roll < 40 ? create(line) : roll < 75 ? applySubstance(line)
+                 : roll < 95 ? removeSubstance(line) : period(line);
+        case Scenario::Ages:
+            return roll < 45 ? create(line, below(2) == 0)
+                 : roll < 60 ? talk(line) : roll < 70 ? attack(line)
+                 : period(line, below(4) ? 1 + below(1000) : 1 + below(INT_MAX));
+        default:
+            return roll < 35 ? create(line) : roll < 50 ? applySubstance(line)
+                 : roll < 60 ? removeSubstance(line) : roll < 75 ? attack(line)
+                 : roll < 95 ? talk(line) : period(line);
+        }
+    }
+
+    // The whole stream, with the leading command count.
+    string generate(size_t commands) {
+        string text = to_string(commands) + "\n";
+        for (size_t i = 0; i < commands; i++) {
+            next(text);
+            text += '\n';
+        }
+        return text;
+    }
+
+private:
+    static constexpr const char* placeNames[] = {"Cage", "Aquarium", "Freedom"};
+    static constexpr const char* kindNames[] = {"M", "F", "B", "BM", "BF", "BB"};
+
+    uint64_t random() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    uint64_t below(uint64_t bound) { return random() % bound; }
+
+    // A random (place, kind) pair with a container, and a position in it.
+    int pickSlot(Place& place, AnimalKind& kind, bool freedom) {
+        while (true) {
+            place = Place(below(freedom ? 3 : 2));
+            kind = AnimalKind(below(6));
+            int slot = slotFor(place, kind);
+            if (slot != noSlot) return slot;
+        }
+    }
+    int position(int slot) {
+        long long population = max<long long>(estimate[slot], 1);
+        return int(below(population + population / 8 + 1));
+    }
+    void append(string& line, Place place, AnimalKind kind) {
+        line += placeNames[size_t(place)];
+        if (place != Place::Freedom) {
+            line += ' ';
+            line += kindNames[size_t(kind)];
+        }
+    }
+
+    // An old animal starts at down to -INT_MAX days, to outlive long PERIODs.
+    Command create(string& line, bool old = false) {
+        Place place;
+        AnimalKind kind;
+        int slot = pickSlot(place, kind, true);
+        ++estimate[slot];
+        line += "CREATE ";
+        line += kindNames[size_t(kind)];
+        line += " n";
+        line += to_string(++created);
+        line += " IN ";
+        line += placeNames[size_t(place)];
+        line += ' ';
+        line += to_string(old ? -int(below(INT_MAX)) : int(below(10)));
+        return Command::Create;
+    }
+    Command talk(string& line) {
+        Place place;
+        AnimalKind kind;
+        int slot = pickSlot(place, kind, true);
+        line += "TALK ";
+        append(line, place, kind);
+        line += ' ';
+        line += to_string(position(slot));
+        return Command::Talk;
+    }
+    Command attack(string& line) {
+        Place place;
+        AnimalKind kind;
+        int slot = pickSlot(place, kind, false);
+        line += "ATTACK ";
+        append(line, place, kind);
+        line += ' ';
+        line += to_string(position(slot));
+        line += ' ';
+        line += to_string(position(slot));
+        estimate[slot] = max(estimate[slot] - 1, 0LL);
+        return Command::Attack;
+    }
+    Command applySubstance(string& line) {
+        Place place;
+        AnimalKind kind;
+        int slot = pickSlot(place, kind, false);
+        line += "APPLY_SUBSTANCE ";
+        append(line, place, kind);
+        line += ' ';
+        line += to_string(position(slot));
+        if (betterKind[size_t(kind)] != AnimalKind::Unknown)
+            ++estimate[slotFor(place, betterKind[size_t(kind)])];
+        else
+            estimate[slot] = 0;
+        return Command::ApplySubstance;
+    }
+    Command removeSubstance(string& line) {
+        Place place;
+        AnimalKind kind;
+        int slot = pickSlot(place, kind, false);
+        line += "REMOVE_SUBSTANCE ";
+        append(line, place, kind);
+        line += ' ';
+        line += to_string(position(slot));
+        return Command::RemoveSubstance;
+    }
+    Command period(string& line) {
+        line += "PERIOD";
+        for (auto& population : estimate)
+            population -= population / 10;
+        return Command::Period;
+    }
+    // PERIOD <K>; only the animals created old are likely to live through it.
+    Command period(string& line, uint64_t days) {
+        line += "PERIOD ";
+        line += to_string(days);
+        for (auto& population : estimate)
+            population -= population / 2;
+        return Command::Period;
+    }
+
+    Scenario scenario;
+    uint64_t state;
+    long long created = 0;
+    array<long long, slotCount> estimate{};
+};
+
+//-----------------------------------------------------
+// Benchmark
+// Generates every scenario at each size, runs it against a fresh world with the
+// output discarded, and reports throughput and latency per command type.
+void runBenchmark(const vector<Scenario>& scenarios, const vector<size_t>& sizes, uint64_t seed) {
+    int devNull = open("/dev/null", O_WRONLY);
+    printf("%-10s %10s %-17s %10s %10s %9s %9s %9s\n",
+           "scenario", "commands", "command", "count", "Mcmd/s", "p50(ns)", "p99(ns)", "max(ns)");
+    for (Scenario scenario : scenarios) {
+        for (size_t size : sizes) {
+            // Generate the stream up front so that only execution is timed.
+            WorkloadGenerator generator(scenario, seed);
+            string text;
+            vector<pair<size_t, Command>> lines;
+            lines.reserve(size);
+            for (size_t i = 0; i < size; i++) {
+                size_t start = text.size();
+                Command command = generator.next(text);
+                lines.emplace_back(start, command);
+            }
+
+            array<LatencyHistogram, commandCount> latency;
+            uint64_t wallStart = nowNanos();
+            {
+                OutputWriter writer(devNull);
+                OutputRedirect redirect(writer);
+                World world;
+                for (size_t i = 0; i < size; i++) {
+                    size_t end = i + 1 < size ? lines[i + 1].first : text.size();
+                    string_view line(text.data() + lines[i].first, end - lines[i].first);
+                    uint64_t start = nowNanos();
+                    world.execute(line);
+                    latency[size_t(lines[i].second)].record(nowNanos() - start);
+                }
+            }
+            double wall = double(nowNanos() - wallStart);
+
+            LatencyHistogram all;
+            for (size_t c = 0; c < commandCount; c++) {
+                const LatencyHistogram& h = latency[c];
+                all.merge(h);
+                if (h.getCount() == 0) continue;
+                printf("%-10s %10zu %-17s %10llu %10.3f %9llu %9llu %9llu\n",
+                       scenarioNames[size_t(scenario)], size, commandNames[c],
+                       (unsigned long long)h.getCount(), h.getCount() * 1e3 / h.getTotal(),
+                       (unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.99),
+                       (unsigned long long)h.getMax());
+            }
+            printf("%-10s %10zu %-17s %10llu %10.3f %9llu %9llu %9llu\n",
+                   scenarioNames[size_t(scenario)], size, "all (wall clock)",
+                   (unsigned long long)all.getCount(), all.getCount() * 1e3 / wall,
+                   (unsigned long long)all.percentile(0.5), (unsigned long long)all.percentile(0.99),
+                   (unsigned long long)all.getMax());
+            fflush(stdout);
+        }
+    }
+    close(devNull);
+}
+
+//-----------------------------------------------------
+// Regression check
+// Two parts, both offline. The output check runs a fixed corpus of generated
+// streams through every execution path and compares a hash of each output with
+// the one recorded from the engine when the corpus was made, so a change to the
+// containers or the command loop cannot alter a single byte unnoticed. The
+// throughput check times each scenario and fails when it is slower than the
+// baseline kept in a file for this machine by more than a tolerance.
+struct GoldenOutput {
+    Scenario scenario;
+    uint64_t seed;
+    size_t commands;
+    uint64_t hash; // FNV-1a of the output
+    size_t bytes;
+};
+
+// Recorded with --regress --record; only to be refreshed when the output is
+// meant to change.
+constexpr GoldenOutput goldenOutputs[] = {
+    {Scenario::Create, 1, 1000, 0x84D46A4694833DDDull, 30683},
+    {Scenario::Create, 2, 10000, 0xC083939ED5AEAB59ull, 316598},
+    {Scenario::Create, 3, 50000, 0xC64513264724632Dull, 1626729},
+    {Scenario::Period, 1, 1000, 0x262528613C3CD295ull, 29384},
+    {Scenario::Period, 2, 10000, 0x397F4429D268D159ull, 309092},
+    {Scenario::Period, 3, 50000, 0x1912A0463567A2E9ull, 1601196},
+    {Scenario::Attack, 1, 1000, 0x97137569C5CD31DBull, 23970},
+    {Scenario::Attack, 2, 10000, 0xFC35E7DF38C8226Aull, 261580},
+    {Scenario::Attack, 3, 50000, 0xB06433B77D82C24Full, 1340579},
+    {Scenario::Substance, 1, 1000, 0x1D57B762C50315D0ull, 27100},
+    {Scenario::Substance, 2, 10000, 0x36C595252820305Eull, 298555},
+    {Scenario::Substance, 3, 50000, 0x5567399A1577E6DEull, 1514252},
+    {Scenario::Mixed, 1, 1000, 0xDA865CBBE45C8380ull, 26108},
+    {Scenario::Mixed, 2, 10000, 0x73C3F420FD8CA73Aull, 287920},
+    {Scenario::Mixed, 3, 50000, 0xBA709E8E457550C8ull, 1472141},
+    {Scenario::Ages, 1, 1000, 0x60C227AC11908F2Eull, 33552},
+    {Scenario::Ages, 2, 10000, 0xC3C697A08E5D7660ull, 331068},
+    {Scenario::Ages, 3, 50000, 0xB4831415288B3D27ull, 1696730},
+};
+
+inline uint64_t threadCpuNanos() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+uint64_t fnv1a(string_view bytes) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (unsigned char c : bytes)
+        hash = (hash ^ c) * 0x100000001B3ull;
+    return hash;
+}
+
+// Input over a copy of the text in an anonymous file, read like standard input.
+class TextInput {
+public:
+    explicit TextInput(const string& text) : fd(memfd_create("commands", 0)) {
+        for (size_t done = 0; fd >= 0 && done < text.size();) {
+            ssize_t n = write(fd, text.data() + done, text.size() - done);
+            if (n <= 0) break;
+            done += n;
+        }
+        lseek(fd, 0, SEEK_SET);
+        input = make_unique<InputReader>(fd);
+    }
+    TextInput(const TextInput&) = delete;
+    TextInput& operator=(const TextInput&) = delete;
+    ~TextInput() {
+        input.reset();
+        if (fd >= 0) close(fd);
+    }
+
+    InputReader& reader() { return *input; }
+
+private:
+    int fd;
+    unique_ptr<InputReader> input;
+};
+
+// The ways a stream can be executed, all of which must give the same output.
+const pair<const char*, void (*)(World&, InputReader&)> executionPaths[] = {
+    {"text", [](World& world, InputReader& input) { runCommands(world, input, false); }},
+    {"pipeline", [](World& world, InputReader& input) { runPipelined(world, input, false); }},
+    {"shards", [](World& world, InputReader& input) { ShardedExecutor(world, 3).run(input, false); }},
+    {"replay", [](World& world, InputReader& input) {
+        string compiled = compileCommands(input, false);
+        replayCommands(world, compiled.data(), compiled.size());
+    }},
+    // The second half runs in a fork, and in the original too with its output
+    // discarded, one command each in turn; neither may see the other's changes.
+    {"fork", [](World& world, InputReader& input) {
+        vector<string> lines;
+        forEachCommandLine(input, false, [&](string_view line) { lines.emplace_back(line); });
+        size_t half = lines.size() / 2;
+        for (size_t i = 0; i < half; i++)
+            world.execute(lines[i]);
+        unique_ptr<World> copy = world.fork();
+        string discarded;
+        OutputWriter sink(discarded);
+        for (size_t i = half; i < lines.size(); i++) {
+            {
+                OutputRedirect redirect(sink);
+                world.execute(lines[i]);
+            }
+            copy->execute(lines[i]);
+        }
+    }},
+};
+
+// Output of a stream run in a fresh world along one execution path.
+string runCaptured(const string& text, void (*path)(World&, InputReader&)) {
+    string output;
+    {
+        OutputWriter writer(output);
+        OutputRedirect redirect(writer);
+        TextInput input(text);
+        World world;
+        path(world, input.reader());
+    }
+    return output;
+}
+
+// Commands per second for a scenario: the best of a few runs of the text path,
+// parsing included, with the output discarded. CPU time of the thread is used
+// rather than wall time, so that other load on the machine counts for less.
+double measureThroughput(Scenario scenario, size_t commands) {
+    string text = WorkloadGenerator(scenario, 1).generate(commands);
+    int devNull = open("/dev/null", O_WRONLY);
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+        TextInput input(text);
+        OutputWriter writer(devNull);
+        OutputRedirect redirect(writer);
+        uint64_t start = threadCpuNanos();
+        {
+            World world;
+            runCommands(world, input.reader(), false);
+        }
+        writer.flush();
+        best = max(best, commands * 1e9 / double(threadCpuNanos() - start));
+    }
+    close(devNull);
+    return best;
+}
+
+// Run both checks and return the number of failures; throughput goes first, while
+// the process is fresh. With record, the baselines are written afresh and the
+// golden table is printed for pasting above.
+int runRegression(const string& baselineFile, double tolerance, size_t commands, bool record) {
+    int failures = 0;
+    // Baselines: one "<scenario> <commands per second>" line each.
+    map<string, double> baselines;
+    if (FILE* file = record ? nullptr : fopen(baselineFile.c_str(), "r")) {
+        char name[32];
+        double rate;
+        while (fscanf(file, "%31s %lf", name, &rate) == 2)
+            baselines[name] = rate;
+        fclose(file);
+    }
+    bool recorded = false;
+    for (size_t i = 0; i < scenarioCount; i++) {
+        double rate = measureThroughput(Scenario(i), commands);
+        auto baseline = baselines.find(scenarioNames[i]);
+        if (baseline == baselines.end()) {
+            baselines[scenarioNames[i]] = rate;
+            recorded = true;
+            printf("throughput %-10s %10.3f Mcmd/s  recorded\n", scenarioNames[i], rate / 1e6);
+            continue;
+        }
+        bool fast = rate >= baseline->second * (1 - tolerance / 100);
+        printf("throughput %-10s %10.3f Mcmd/s  baseline %10.3f  %s\n", scenarioNames[i], rate / 1e6,
+               baseline->second / 1e6, fast ? "ok" : "SLOWER");
+        failures += !fast;
+    }
+    if (recorded) {
+        FILE* file = fopen(baselineFile.c_str(), "w");
+        if (!file) {
+            fprintf(stderr, "%s: %s\n", baselineFile.c_str(), strerror(errno));
+            return failures + 1;
+        }
+        for (auto& baseline : baselines)
+            fprintf(file, "%s %.0f\n", baseline.first.c_str(), baseline.second);
+        fclose(file);
+    }
+
+    if (record)
+        printf("constexpr GoldenOutput goldenOutputs[] = {\n");
+    for (const GoldenOutput& golden : goldenOutputs) {
+        string text = WorkloadGenerator(golden.scenario, golden.seed).generate(golden.commands);
+        if (record) {
+            string output = runCaptured(text, executionPaths[0].second);
+            printf("    {Scenario::%c%s, %llu, %zu, 0x%016llXull, %zu},\n",
+                   toupper(scenarioNames[size_t(golden.scenario)][0]), scenarioNames[size_t(golden.scenario)] + 1,
+                   (unsigned long long)golden.seed, golden.commands, (unsigned long long)fnv1a(output), output.size());
+            continue;
+        }
+        for (auto& path : executionPaths) {
+            string output = runCaptured(text, path.second);
+            bool same = fnv1a(output) == golden.hash && output.size() == golden.bytes;
+            printf("output     %-10s seed %-3llu %8zu commands %-9s %s\n", scenarioNames[size_t(golden.scenario)],
+                   (unsigned long long)golden.seed, golden.commands, path.first, same ? "ok" : "DIFFERS");
+            failures += !same;
+        }
+    }
+    if (record)
+        printf("};\n");
+    return failures;
+}
+
+//-----------------------------------------------------
+// Statistics report
+// Written at exit, as a table on stderr or as JSON into a file.
+void reportStats(const Stats& report, FILE* file, bool json) {
+    auto latency = [&](const LatencyHistogram& h) {
+        fprintf(file, json ? "{\"count\": %llu, \"total_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+                             "\"p99_ns\": %llu, \"max_ns\": %llu"
+                           : "%10llu %14llu %9llu %9llu %9llu %10llu",
+                (unsigned long long)h.getCount(), (unsigned long long)h.getTotal(),
+                (unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.9),
+                (unsigned long long)h.percentile(0.99), (unsigned long long)h.getMax());
+    };
+    const pair<const char*, uint64_t> counters[] = {
+        {"sorts", report.sorts},
+        {"remove_steps", report.removeSteps},
+        {"deaths", report.deaths},
+        {"attack_kills", report.attackKills},
+        {"monster_conversions", report.monsterConversions},
+    };
+
+    if (json) {
+        fprintf(file, "{\n  \"commands\": {");
+        for (size_t c = 0; c < commandCount; c++) {
+            fprintf(file, "%s\n    \"%s\": ", c ? "," : "", commandNames[c]);
+            latency(report.commands[c]);
+            fprintf(file, "}");
+        }
+        fprintf(file, "\n  },\n  \"containers\": {");
+        for (size_t slot = 0; slot < slotCount; slot++) {
+            fprintf(file, "%s\n    \"%s\": ", slot ? "," : "", slotNames[slot]);
+            latency(report.containers[slot]);
+            fprintf(file, ", \"peak_size\": %zu}", report.peakSize[slot]);
+        }
+        fprintf(file, "\n  },\n  \"counters\": {");
+        for (size_t i = 0; i < size(counters); i++)
+            fprintf(file, "%s\n    \"%s\": %llu", i ? "," : "", counters[i].first,
+                    (unsigned long long)counters[i].second);
+        fprintf(file, "\n  }\n}\n");
+        return;
+    }
+
+    fprintf(file, "%-22s %10s %14s %9s %9s %9s %10s %10s\n",
+            "command / container", "count", "total(ns)", "p50(ns)", "p90(ns)", "p99(ns)", "max(ns)", "peak size");
+    for (size_t c = 0; c < commandCount; c++) {
+        fprintf(file, "%-22s ", commandNames[c]);
+        latency(report.commands[c]);
+        fprintf(file, "\n");
+    }
+    for (size_t slot = 0; slot < slotCount; slot++) {
+        fprintf(file, "%-22s ", slotNames[slot]);
+        latency(report.containers[slot]);
+        fprintf(file, " %10zu\n", report.peakSize[slot]);
+    }
+    for (auto& counter : counters)
+        fprintf(file, "%-22s %10llu\n", counter.first, (unsigned long long)counter.second);
+}
+
+//-----------------------------------------------------
+// Main function: processes commands from the console.
+// Usage: Assignment2 [--stream] [--async-output] [--stats[=FILE]]
+//        Assignment2 --batch [--jobs N] [--out-dir DIR] [--stream] [--stats[=FILE]] FILE...
+//        Assignment2 --fork [--jobs N] [--out-dir DIR] [--stream] FILE... < prefix.txt
+//        Assignment2 [--restore FILE] [--snapshot FILE [--snapshot-every N]] [--replay FILE] ...
+//        Assignment2 --shards N [--stream] [--async-output] < commands.txt
+//        Assignment2 --pipeline [--stream] [--async-output] [--stats[=FILE]] < commands.txt
+//        Assignment2 --serve SOCKET
+//        Assignment2 --connect SOCKET < commands.txt
+//        Assignment2 --compile FILE [--stream] < commands.txt
+//        Assignment2 --replay FILE [--async-output] [--stats[=FILE]]
+//        Assignment2 --generate SCENARIO COMMANDS [--seed S]
+//        Assignment2 --bench [--scenario SCENARIO] [--max-size N] [--seed S]
+//        Assignment2 --regress [--baseline FILE] [--tolerance PCT] [--record]
+//   --stream        ignore the leading command count and run until end of input.
+//   --async-output  write output from a background thread.
+//   --stats[=FILE]  time every command and count container operations; the
+//                   report goes to stderr, or as JSON into FILE, at exit.
+//   --batch         run every FILE in its own world, in parallel, into FILE.out.
+//   --jobs N        number of worker threads for --batch (default: all cores).
+//   --out-dir DIR   write the --batch outputs into DIR instead.
+//   --fork          run standard input, then fork the world once per FILE and run
+//                   each FILE in its fork, in parallel, into FILE.out.
+//   --compile       compile the text commands into the binary format, into FILE.
+//   --replay        execute a compiled FILE; the output is the same as for the text.
+//   --shards N      run the containers on N threads (at most 5), with the same output.
+//   --pipeline      parse on one thread and execute on another (and write the
+//                   output on a third with --async-output).
+//   --serve         serve commands on a Unix socket, with a world per connection;
+//                   commands are streamed, without a count line.
+//   --connect       send standard input to a server and print its answers.
+//   --snapshot FILE write a snapshot of the world into FILE at the end of the run,
+//                   and with --snapshot-every N also after every N commands.
+//   --restore FILE  start from the world in a snapshot and skip the commands it
+//                   had already run.
+//   --generate      print a generated command stream (create, period, attack,
+//                   substance, mixed, or ages: old animals and long PERIODs) of
+//                   the given length.
+//   --bench         time every scenario (or one) at sizes from 10^3 to --max-size
+//                   (default 10^6) and report per-command throughput and latency.
+//   --regress       check the output of a fixed corpus along every execution path
+//                   against recorded hashes, and the throughput of each scenario
+//                   against the baselines in FILE (default regress-baseline.txt),
+//                   failing if it is more than PCT percent (default 20) slower.
+//                   Missing baselines are recorded; --record records all of them
+//                   again and prints the output hashes of the corpus.
+int main(int argc, char* argv[]){
+    bool streaming = false;
+    bool batch = false;
+    bool bench = false;
+    bool regress = false, record = false;
+    string baselineFile = "regress-baseline.txt";
+    double tolerance = 20;
+    bool withStats = false;
+    string statsFile;
+    string generate, compileTo, replayFrom;
+    string snapshotTo, restoreFrom;
+    uint64_t snapshotEvery = 0;
+    size_t shards = 0;
+    string serveAt, connectTo;
+    bool pipeline = false;
+    size_t commands = 0, maxSize = 1000000;
+    uint64_t seed = 1;
+    vector<Scenario> scenarios;
+    size_t jobs = max(1u, thread::hardware_concurrency());
+    string outDir;
+    bool forkBranches = false;
+    vector<string> files;
+    for (int i = 1; i < argc; i++) {
+        string_view arg = argv[i];
+        if (arg == "--stream")
+            streaming = true;
+        else if (arg == "--async-output")
+            stdoutWriter.startBackground();
+        else if (arg == "--batch")
+            batch = true;
+        else if (arg == "--jobs" && i + 1 < argc)
+            jobs = max(1, atoi(argv[++i]));
+        else if (arg == "--out-dir" && i + 1 < argc)
+            outDir = argv[++i];
+        else if (arg == "--fork")
+            forkBranches = true;
+        else if (arg == "--generate" && i + 2 < argc) {
+            generate = argv[++i];
+            commands = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--compile" && i + 1 < argc)
+            compileTo = argv[++i];
+        else if (arg == "--replay" && i + 1 < argc)
+            replayFrom = argv[++i];
+        else if (arg == "--snapshot" && i + 1 < argc)
+            snapshotTo = argv[++i];
+        else if (arg == "--snapshot-every" && i + 1 < argc)
+            snapshotEvery = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--restore" && i + 1 < argc)
+            restoreFrom = argv[++i];
+        else if (arg == "--shards" && i + 1 < argc)
+            shards = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--serve" && i + 1 < argc)
+            serveAt = argv[++i];
+        else if (arg == "--connect" && i + 1 < argc)
+            connectTo = argv[++i];
+        else if (arg == "--pipeline")
+            pipeline = true;
+        else if (arg == "--bench")
+            bench = true;
+        else if (arg == "--regress")
+            regress = true;
+        else if (arg == "--record")
+            record = true;
+        else if (arg == "--baseline" && i + 1 < argc)
+            baselineFile = argv[++i];
+        else if (arg == "--tolerance" && i + 1 < argc)
+            tolerance = strtod(argv[++i], nullptr);
+        else if (arg == "--stats")
+            withStats = true;
+        else if (arg.substr(0, 8) == "--stats=") {
+            withStats = true;
+            statsFile = string(arg.substr(8));
+        }
+        else if (arg == "--scenario" && i + 1 < argc)
+            scenarios.push_back(parseScenario(argv[++i]));
+        else if (arg == "--max-size" && i + 1 < argc)
+            maxSize = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--seed" && i + 1 < argc)
+            seed = strtoull(argv[++i], nullptr, 10);
+        else
+            files.emplace_back(arg);
+    }
+    // Output produced before an uncaught exception must still reach the file.
+    static terminate_handler previousHandler = nullptr;
+    previousHandler = set_terminate([] {
+        out().flush();
+        previousHandler ? previousHandler() : abort();
+    });
+
+    unique_ptr<Stats> totals;
+    if (withStats)
+        totals = make_unique<Stats>(commandCount, slotCount);
+    // Report the statistics once the run is over.
+    auto report = [&] {
+        if (!totals) return;
+        stats = nullptr;
+        FILE* file = statsFile.empty() ? stderr : fopen(statsFile.c_str(), "w");
+        if (!file) {
+            fprintf(stderr, "%s: %s\n", statsFile.c_str(), strerror(errno));
+            return;
+        }
+        reportStats(*totals, file, !statsFile.empty());
+        if (file != stderr) fclose(file);
+    };
+
+    if (!serveAt.empty()) {
+        static volatile sig_atomic_t stopped = 0;
+        struct sigaction action{};
+        action.sa_handler = [](int) { stopped = 1; };
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        signal(SIGPIPE, SIG_IGN);
+        Server server(serveAt);
+        if (!server.isOpen()) {
+            fprintf(stderr, "%s: %s\n", serveAt.c_str(), strerror(errno));
+            return 1;
+        }
+        server.run(stopped);
+        return 0;
+    }
+    if (!connectTo.empty())
+        return runClient(connectTo);
+    if (batch) {
+        int failures = runBatch(files, outDir, jobs, streaming, totals.get());
+        report();
+        return failures == 0 ? 0 : 1;
+    }
+    if (!generate.empty()) {
+        Scenario scenario = parseScenario(generate);
+        if (scenario == Scenario::Unknown) {
+            fprintf(stderr, "unknown scenario: %s\n", generate.c_str());
+            return 1;
+        }
+        stdoutWriter << WorkloadGenerator(scenario, seed).generate(commands);
+        return 0;
+    }
+    if (bench) {
+        if (scenarios.empty())
+            for (size_t i = 0; i < scenarioCount; i++)
+                scenarios.push_back(Scenario(i));
+        if (find(scenarios.begin(), scenarios.end(), Scenario::Unknown) != scenarios.end()) {
+            fprintf(stderr, "unknown scenario\n");
+            return 1;
+        }
+        vector<size_t> sizes;
+        for (size_t size = 1000; size <= maxSize; size *= 10)
+            sizes.push_back(size);
+        runBenchmark(scenarios, sizes, seed);
+        return 0;
+    }
+    if (regress)
+        return runRegression(baselineFile, tolerance, 200000, record) == 0 ? 0 : 1;
+
+    if (!compileTo.empty()) {
+        InputReader input(STDIN_FILENO);
+        string compiled = compileCommands(input, streaming);
+        int fd = open(compileTo.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", compileTo.c_str(), strerror(errno));
+            return 1;
+        }
+        OutputWriter(fd) << compiled;
+        close(fd);
+        return 0;
+    }
+    World world;
+    if (!restoreFrom.empty()) {
+        MappedFile file(restoreFrom);
+        if (!file.isOpen()) {
+            fprintf(stderr, "%s: %s\n", restoreFrom.c_str(), strerror(errno));
+            return 1;
+        }
+        if (!restoreSnapshot(world, file.data(), file.size())) {
+            fprintf(stderr, "%s: not a valid snapshot\n", restoreFrom.c_str());
+            return 1;
+        }
+    }
+    if (!snapshotTo.empty())
+        world.checkpointTo(snapshotTo, snapshotEvery);
+
+    bool valid = true;
+    stats = totals.get();
+    if (!replayFrom.empty()) {
+        MappedFile file(replayFrom);
+        if (!file.isOpen()) {
+            fprintf(stderr, "%s: %s\n", replayFrom.c_str(), strerror(errno));
+            return 1;
+        }
+        valid = replayCommands(world, file.data(), file.size());
+        if (!valid)
+            fprintf(stderr, "%s: not a valid compiled command stream\n", replayFrom.c_str());
+    }
+    else if (shards > 0) {
+        InputReader input(STDIN_FILENO);
+        ShardedExecutor(world, shards).run(input, streaming);
+    }
+    else if (pipeline) {
+        InputReader input(STDIN_FILENO);
+        runPipelined(world, input, streaming);
+    }
+    else {
+        InputReader input(STDIN_FILENO);
+        runCommands(world, input, streaming);
+    }
+    if (forkBranches && valid) {
+        stdoutWriter.flush();
+        if (runBatch(files, outDir, jobs, streaming, totals.get(), &world) != 0)
+            valid = false;
+    }
+    if (!snapshotTo.empty() && !world.checkpoint())
+        valid = false;
+    stdoutWriter.flush();
+    report();
+
+    return valid ? 0 : 1;
 }